@@ -0,0 +1,163 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include "qrgrid.h"
+
+// Word-parallel helpers for the mask penalty rules, on lines of gridWords
+// words with bit x of a line in word x / 64.  They are templates so the
+// same code scores one symbol with uint64_t words, or batchLanes symbols
+// at once with LaneWords, one symbol per vector lane.  Counts are added
+// into a Word, so each lane keeps its own.  They are always inlined, so the
+// AVX2 and AVX-512 lane kernels get their own vector copies.
+
+#define batchLanes 8
+typedef uint64_t LaneWords __attribute__((vector_size(batchLanes * 8)));
+
+static inline __attribute__((always_inline))
+void countBits(const uint64_t &word, uint64_t *count) {
+  *count += __builtin_popcountll(word);
+}
+
+static inline __attribute__((always_inline))
+void countBits(const LaneWords &word, LaneWords *count) {
+  for (int i = 0; i < batchLanes; i++) {
+    (*count)[i] += __builtin_popcountll(word[i]);
+  }
+}
+
+// out gets line moved down k bits, so bit x holds module x + k.
+template <typename Word>
+static inline __attribute__((always_inline))
+void shiftDown(const Word *line, int k, Word *out) {
+  for (int w = 0; w < gridWords; w++) {
+    out[w] = line[w] >> k;
+    if (k && w + 1 < gridWords) {
+      out[w] |= line[w + 1] << (64 - k);
+    }
+  }
+}
+
+// out gets line moved up a bit, so bit x holds module x - 1.
+template <typename Word>
+static inline __attribute__((always_inline))
+void shiftUp(const Word *line, Word *out) {
+  for (int w = gridWords - 1; w >= 0; w--) {
+    out[w] = line[w] << 1;
+    if (w) {
+      out[w] |= line[w - 1] >> 63;
+    }
+  }
+}
+
+// out gets the lowest n bits set.
+template <typename Word>
+static inline __attribute__((always_inline))
+void lowBits(int n, Word *out) {
+  for (int w = 0; w < gridWords; w++, n -= 64) {
+    out[w] = Word{} | (n >= 64 ? ~0ull : n > 0 ? (1ull << n) - 1 : 0);
+  }
+}
+
+template <typename Word>
+static inline __attribute__((always_inline))
+void countLine(const Word *line, Word *count) {
+  for (int w = 0; w < gridWords; w++) {
+    countBits(line[w], count);
+  }
+}
+
+// Rule 1: a run of n >= 5 matching modules costs n - 2.
+template <typename Word>
+static inline __attribute__((always_inline))
+void runPenalty(const Word *line, int size, Word *penalty) {
+  Word same[gridWords], window[gridWords], shifted[gridWords];
+  shiftDown(line, 1, shifted);
+  for (int w = 0; w < gridWords; w++) {
+    same[w] = ~(line[w] ^ shifted[w]);
+  }
+  // bit x of window is set when modules x to x + 4 all match.
+  lowBits(size - 4, window);
+  for (int k = 0; k < 4; k++) {
+    shiftDown(same, k, shifted);
+    for (int w = 0; w < gridWords; w++) {
+      window[w] &= shifted[w];
+    }
+  }
+  // a run of n has n - 4 windows, so add 2 for the window that starts it.
+  shiftUp(window, shifted);
+  for (int w = 0; w < gridWords; w++) {
+    shifted[w] = window[w] & ~shifted[w];
+  }
+  countLine(window, penalty);
+  countLine(shifted, penalty);
+  countLine(shifted, penalty);
+}
+
+// Rule 2: the 2x2 blocks of one color with their top left in row.  valid
+// holds the lowest size - 1 bits.
+template <typename Word>
+static inline __attribute__((always_inline))
+void blockCount(const Word *row, const Word *below,
+                              const Word *valid, Word *count) {
+  Word blocks[gridWords], next[gridWords];
+  // modules that match the one below, and the one to their right.
+  for (int w = 0; w < gridWords; w++) {
+    blocks[w] = ~(row[w] ^ below[w]);
+  }
+  shiftDown(blocks, 1, next);
+  for (int w = 0; w < gridWords; w++) {
+    blocks[w] &= next[w];
+  }
+  shiftDown(row, 1, next);
+  for (int w = 0; w < gridWords; w++) {
+    blocks[w] &= ~(row[w] ^ next[w]) & valid[w];
+  }
+  countLine(blocks, count);
+}
+
+// Rule 3: both patterns are the 1:1:3:1:1 core of a finder pattern with 4
+// light modules on one side, so each line finds its cores and light runs
+// once, then lines them up for either side.
+template <typename Word>
+static inline __attribute__((always_inline))
+void finderCount(const Word *line, int size, Word *count) {
+  Word shifted[7][gridWords], core[gridWords], light[gridWords];
+  Word coreFirst[gridWords], lightFirst[gridWords], valid[gridWords];
+  for (int k = 1; k < 7; k++) {
+    shiftDown(line, k, shifted[k]);
+  }
+  for (int w = 0; w < gridWords; w++) {
+    // modules x to x + 6 are dark, light, dark, dark, dark, light, dark.
+    core[w] = line[w] & ~shifted[1][w] & shifted[2][w] & shifted[3][w] &
+        shifted[4][w] & ~shifted[5][w] & shifted[6][w];
+    // modules x to x + 3 are light.
+    light[w] = ~(line[w] | shifted[1][w] | shifted[2][w] | shifted[3][w]);
+  }
+  lowBits(size - 10, valid);
+  shiftDown(light, 7, coreFirst);
+  shiftDown(core, 4, lightFirst);
+  for (int w = 0; w < gridWords; w++) {
+    coreFirst[w] &= core[w] & valid[w];
+    lightFirst[w] &= light[w] & valid[w];
+  }
+  countLine(coreFirst, count);
+  countLine(lightFirst, count);
+}
+
+// Rule 4: 10 for every 5% the dark modules are away from half.
+static inline __attribute__((always_inline))
+int darkPenalty(int dark, int size) {
+  dark = (dark * 100) / (size * size);
+  int prevFive = dark / 5;
+  prevFive *= 5;
+  int nextFive = prevFive + 5;
+  prevFive = abs(prevFive - 50) / 5;
+  nextFive = abs(nextFive - 50) / 5;
+  if (prevFive < nextFive) {
+    return prevFive * 10;
+  }
+  return nextFive * 10;
+}
@@ -1,40 +1,99 @@
 /** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
 
 #include "bitstream.h"
+#include <cstring>
+
+// Alternating pad codewords, long enough to fill most streams in one copy.
+struct PadPattern {
+  uint8_t bytes[256];
+
+  constexpr PadPattern() : bytes() {
+    for (int i = 0; i < 256; i++) {
+      bytes[i] = (i & 1) ? 0x11 : 0xec;
+    }
+  }
+};
+
+static constexpr PadPattern padPattern;
 
 void BitStream::write(uint32_t value, int bits) {
-  value <<= 32 - bits;
-  for (int i = 0; i < bits; i++) {
-    data[length] |= (value & 0x80000000) >> (24 + bitPos);
-    value <<= 1;
-    bitPos++;
-    if (bitPos == 8) {
-      bitPos = 0;
-      length++;
+  if (length * 8 + bitPos + bits > capacity * 8) {
+    overflow = true;
+    return;
+  }
+  if (bits < 32) {
+    value &= (1u << bits) - 1;
+  }
+  accumulator = (accumulator << bits) | value;
+  bitPos += bits;
+  if (bitPos >= 32) {
+    bitPos -= 32;
+    uint32_t word = accumulator >> bitPos;
+    data[length++] = word >> 24;
+    data[length++] = word >> 16;
+    data[length++] = word >> 8;
+    data[length++] = word;
+  }
+}
+
+void BitStream::writeBytes(const uint8_t *bytes, uint32_t count) {
+  if (length * 8 + bitPos + count * 8 > capacity * 8) {
+    overflow = true;
+    return;
+  }
+  if (bitPos & 7) {
+    // unaligned, so shift the bytes in a word at a time.
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+      write((bytes[i] << 24) | (bytes[i + 1] << 16) | (bytes[i + 2] << 8) |
+            bytes[i + 3], 32);
+    }
+    for (; i < count; i++) {
+      write(bytes[i], 8);
     }
+    return;
+  }
+  flush();
+  memcpy(data + length, bytes, count);
+  length += count;
+}
+
+uint32_t BitStream::bitLength() const {
+  return length * 8 + bitPos;
+}
+
+void BitStream::flush() {
+  while (bitPos >= 8) {
+    bitPos -= 8;
+    data[length++] = accumulator >> bitPos;
   }
 }
 
 void BitStream::padToByte() {
-  if (bitPos > 0) {
-    length++;
+  if (bitPos & 7) {
+    write(0, 8 - (bitPos & 7));
   }
-  bitPos = 0;
+  flush();
 }
 
-void BitStream::padToCapacity(uint32_t capacity) {
+void BitStream::padToCapacity() {
   // first add up to 4 terminator bits.
-  int usedBits = length * 8 + (8 - bitPos);
+  int usedBits = length * 8 + bitPos;
+  int capacityBits = capacity * 8;
   int terminatorBits = 4;
-  if (usedBits + terminatorBits > capacity * 8) {
-    terminatorBits = capacity * 8 - usedBits;
+  if (usedBits + terminatorBits > capacityBits) {
+    terminatorBits = capacityBits - usedBits;
   }
   write(0, terminatorBits);
   // now pad to next byte
   padToByte();
-  bool first = true;
+  // the pattern has even length, so every copy starts on 0xec.
   while (length < capacity) {
-    data[length++] = first ? 236 : 17;
-    first = !first;
+    uint32_t count = capacity - length;
+    if (count > sizeof(padPattern.bytes)) {
+      count = sizeof(padPattern.bytes);
+    }
+    memcpy(data + length, padPattern.bytes, count);
+    length += count;
   }
 }
@@ -6,13 +6,20 @@
 
 class BitStream {
  public:
-  uint32_t length = 0;
+  uint32_t length = 0;  // whole bytes flushed to data
   uint8_t *data = nullptr;
+  uint32_t capacity = 0;  // size of data in bytes
+  bool overflow = false;  // set if a write would have passed capacity
 
   void write(uint32_t value, int bits);
+  void writeBytes(const uint8_t *bytes, uint32_t count);
   void padToByte();
-  void padToCapacity(uint32_t capacity);
+  void padToCapacity();
+  uint32_t bitLength() const;
 
  private:
-  int bitPos = 0;
+  void flush();
+
+  uint64_t accumulator = 0;  // pending bits, right aligned
+  int bitPos = 0;  // number of pending bits
 };
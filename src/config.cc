@@ -3,6 +3,7 @@
 #include "config.h"
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 
 Config::Config(std::shared_ptr<JSONData> json) {
   if (json == nullptr) {
@@ -107,6 +108,37 @@ Config::Config(std::shared_ptr<JSONData> json) {
       }
     }
   }
+  if (json->has("micro")) {
+    micro = json->at("micro")->asBool();
+  }
+  if (json->has("parallelMasks")) {
+    parallelMasks = json->at("parallelMasks")->asBool();
+  }
+  if (json->has("maskMode")) {
+    std::string mode = json->at("maskMode")->asString();
+    std::transform(mode.begin(), mode.end(), mode.begin(), ::tolower);
+    if (mode == "optimal") {
+      maskMode = MaskMode::Optimal;
+    } else if (mode == "fast") {
+      maskMode = MaskMode::Fast;
+    } else if (mode.length() == 7 && mode.compare(0, 6, "fixed:") == 0 &&
+               mode[6] >= '0' && mode[6] <= '7') {
+      maskMode = MaskMode::Fixed;
+      fixedMask = mode[6] - '0';
+    } else {
+      std::cerr << "Mask Mode must be one of 'optimal', 'fast', or"
+                " 'fixed:0' through 'fixed:7'" << std::endl;
+    }
+  }
+  if (json->has("maskBudget")) {
+    double budget = json->at("maskBudget")->asNumber();
+    if (budget >= 0 && budget <= UINT32_MAX && budget == floor(budget)) {
+      maskBudget = budget;
+    } else {
+      std::cerr << "Mask Budget must be a whole number of microseconds"
+                " from 0 to " << UINT32_MAX << std::endl;
+    }
+  }
 }
 
 uint32_t Config::parseColor(const std::string &s) {
@@ -5,6 +5,7 @@
 #include <memory>
 #include "json.h"
 #include "qrencoder.h"
+#include "qrgrid.h"
 
 enum class Style {
   None = 0,
@@ -44,6 +45,11 @@ class Config {
   Style style = Style::None;
   PatternStyle pattern = PatternStyle::None;
   uint8_t corners = 0;
+  bool micro = false;
+  bool parallelMasks = false;
+  MaskMode maskMode = MaskMode::Optimal;
+  int fixedMask = 0;
+  uint32_t maskBudget = 0;
 
  private:
   uint32_t parseColor(const std::string &s);
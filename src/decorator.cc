@@ -6,129 +6,317 @@
 #include <cstdlib>
 #include <iostream>
 #include <cmath>
-
-void Decorator::decorate(const Bitmap &bitmap, const Config &config,
-                         const char *embed, const char *filename, const bool gray, const unsigned int ppi_x, const unsigned int ppi_y) {
-
-  int width = config.scale * bitmap.size + config.padding * 2 + config.border * 2;
-  int height = config.scale * bitmap.size + config.padding * 2 + config.border * 2;
-  uint8_t *pixels = new uint8_t[width * 4 * height];
-
-  // Apply background color.
-  int offset = 0;
-  for (int i = 0; i < width * height; i++) {
-    pixels[offset++] = config.backgroundColor >> 16;
-    pixels[offset++] = (config.backgroundColor >> 8) & 0xff;
-    pixels[offset++] = config.backgroundColor & 0xff;
-    pixels[offset++] = 0xff;  // alpha
+#include <cstring>
+#include <algorithm>
+#include <list>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// The colors for each class and whole step of coverage, as RGBA bytes
+// ready to copy out, and as 8.8 fixed point channels to mix between steps.
+struct Palette {
+  uint32_t rgba[pixelClasses * 256];
+  uint16_t steps[pixelClasses * 256][3];
+};
+
+typedef void (*ColorKernel)(const uint8_t *classes, const uint16_t *coverage,
+                            size_t count, const Palette &palette,
+                            uint8_t *out);
+
+static void colorScalar(const uint8_t *classes, const uint16_t *coverage,
+                        size_t count, const Palette &palette,
+                        uint8_t *out) {
+  for (size_t i = 0; i < count; i++) {
+    int index = classes[i] << 8 | coverage[i] >> 8;
+    uint32_t weight = coverage[i] & 0xff;
+    if (!weight) {
+      memcpy(out + i * 4, &palette.rgba[index], 4);
+      continue;
+    }
+    // Between steps the two nearest are mixed.
+    const uint16_t *low = palette.steps[index];
+    const uint16_t *high = palette.steps[index + 1];
+    for (int c = 0; c < 3; c++) {
+      uint32_t mixed = (low[c] * (256 - weight) + high[c] * weight) >> 8;
+      out[i * 4 + c] = mixed >> 8;
+    }
+    out[i * 4 + 3] = 0xff;  // alpha
   }
+}
 
-  // Apply border.
-  for (int j = 0; j < config.border; j++) {
-    for (int i = 0; i < width; i++) {
-      offset = j * width * 4 + i * 4;
-      pixels[offset++] = config.borderColor >> 16;
-      pixels[offset++] = (config.borderColor >> 8) & 0xff;
-      pixels[offset++] = config.borderColor & 0xff;
-      pixels[offset++] = 0xff;  // alpha
+#ifdef HAVE_X86_KERNELS
+
+// Looks up 8 pixels at a time with one gather.  Runs with an edge pixel
+// between steps are few, and go through the scalar mix.
+__attribute__((target("avx2")))
+static void colorAVX2(const uint8_t *classes, const uint16_t *coverage,
+                      size_t count, const Palette &palette, uint8_t *out) {
+  const __m128i fraction = _mm_set1_epi16(0xff);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i position = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(coverage + i));
+    if (!_mm_testz_si128(position, fraction)) {
+      colorScalar(classes + i, coverage + i, 8, palette, out + i * 4);
+      continue;
     }
+    __m256i shape = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i *>(classes + i)));
+    __m256i step = _mm256_cvtepu16_epi32(_mm_srli_epi16(position, 8));
+    __m256i index = _mm256_or_si256(_mm256_slli_epi32(shape, 8), step);
+    __m256i rgba = _mm256_i32gather_epi32(
+        reinterpret_cast<const int *>(palette.rgba), index, 4);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 4), rgba);
+  }
+  colorScalar(classes + i, coverage + i, count - i, palette, out + i * 4);
+}
 
-    for (int i = 0; i < width; i++) {
-      offset = (height - j - 1) * width * 4 + i * 4;
-      pixels[offset++] = config.borderColor >> 16;
-      pixels[offset++] = (config.borderColor >> 8) & 0xff;
-      pixels[offset++] = config.borderColor & 0xff;
-      pixels[offset++] = 0xff;  // alpha
-    }
+#endif  // HAVE_X86_KERNELS
 
-    for (int i = config.border; i < height - config.border; i++) {
-      offset = i * width * 4 + j * 4;
-      pixels[offset++] = config.borderColor >> 16;
-      pixels[offset++] = (config.borderColor >> 8) & 0xff;
-      pixels[offset++] = config.borderColor & 0xff;
-      pixels[offset++] = 0xff;  // alpha
-
-      offset = i * width * 4 + (width - j - 1) * 4;
-      pixels[offset++] = config.borderColor >> 16;
-      pixels[offset++] = (config.borderColor >> 8) & 0xff;
-      pixels[offset++] = config.borderColor & 0xff;
-      pixels[offset++] = 0xff;  // alpha
+static ColorKernel colorKernel() {
+  static const ColorKernel kernel = [] {
+    ColorKernel k = colorScalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      k = colorAVX2;
     }
-  }
+#endif
+    return k;
+  }();
+  return kernel;
+}
 
-  offset = 0;
+void Decorator::decorate(const Bitmap &bitmap, const Config &config,
+                         const char *embed, const char *filename, const bool gray, const unsigned int ppi_x, const unsigned int ppi_y) {
+  Image image = render(bitmap, config, embed);
+  save(image, filename, gray, ppi_x, ppi_y);
+  delete [] image.pixels;
+}
+
+Image Decorator::render(const Bitmap &bitmap, const Config &config,
+                        const char *embed) {
+  return colorize(rasterize(bitmap, config, embed), config);
+}
+
+CoverageMap Decorator::rasterize(const Bitmap &bitmap, const Config &config,
+                                 const char *embed) {
+  std::shared_ptr<const StaticLayers> layers =
+      staticLayers(bitmap, config, embed);
+  CoverageMap map = layers->base;
+  int width = map.width;
+
+  std::vector<uint8_t> masks(bitmap.size * bitmap.size);
+  connectivity(bitmap, config, masks.data());
+  int offset = 0;
   for (int y = 0; y < bitmap.size; y++) {
-    int outOffset = (y * config.scale + config.padding + config.border) * width * 4 + config.padding * 4 + config.border * 4;
+    int outOffset = (y * config.scale + config.padding + config.border) *
+        width + config.padding + config.border;
     for (int x = 0; x < bitmap.size; x++) {
       if (bitmap.data[offset] != Color::BG &&
           bitmap.data[offset] != Color::Empty &&
           bitmap.data[offset] != Color::Pattern &&
           bitmap.data[offset] != Color::CodeOff) {
-        uint8_t mask = 0x0;
-        uint32_t color = getColor(bitmap.data[offset], config);
-        // check above
-        if (y > 0 &&
-            getColor(bitmap.data[offset - bitmap.size], config) == color) {
-          mask |= 0x1;
-        }
-        // check left
-        if (x > 0 && getColor(bitmap.data[offset - 1], config) == color) {
-          mask |= 0x2;
+        PixelClass shape = moduleClass(bitmap.data[offset]);
+        const uint16_t *dot = layers->dots[masks[offset]].data();
+        for (uint32_t row = 0; row < config.scale; row++) {
+          memset(map.classes.data() + outOffset + row * width,
+                 static_cast<uint8_t>(shape), config.scale);
+          memcpy(map.coverage.data() + outOffset + row * width,
+                 dot + row * config.scale, config.scale * sizeof(*dot));
         }
-        // check below
-        if (y < bitmap.size - 1 &&
-            getColor(bitmap.data[offset + bitmap.size], config) == color) {
-          mask |= 0x4;
-        }
-        // check right
-        if (x < bitmap.size - 1 &&
-            getColor(bitmap.data[offset + 1], config) == color) {
-          mask |= 0x8;
-        }
-        switch (config.style) {
-          case Style::None:
-            mask |= 0xf;  // all connected
-            break;
-          case Style::Dots:
-            mask &= 0x0;  // all disconnected
-            break;
-          case Style::HDots:
-            mask &= 0xa;  // no vertical connections
-            break;
-          case Style::VDots:
-            mask &= 0x5;  // no horizontal connections
-            break;
-          case Style::HVDots:  // blend everything
-            break;
-        }
-        drawDot(pixels + outOffset, width * 4, color, config.backgroundColor,
-                config.scale, mask);
       }
-      outOffset += config.scale * 4;
+      outOffset += config.scale;
       offset++;
     }
   }
+
+  // The icon goes over the modules wherever it's opaque.
+  const CoverageMap &icon = layers->icon;
+  int start = 8 * config.scale + config.padding + config.border;
+  for (int y = 0; y < icon.height; y++) {
+    int src = y * icon.width;
+    int dest = (start + y) * width + start;
+    for (int x = 0; x < icon.width; x++) {
+      if (icon.classes[src + x] == static_cast<uint8_t>(PixelClass::Icon)) {
+        map.classes[dest + x] = icon.classes[src + x];
+        map.coverage[dest + x] = icon.coverage[src + x];
+      }
+    }
+  }
+  return map;
+}
+
+Image Decorator::colorize(const CoverageMap &map, const Config &config) {
+  // Every class has a ramp from the background up to its color.  Batches
+  // mostly use one color scheme, so each thread keeps its last palette.
+  uint32_t colors[pixelClasses];
+  classColors(config, colors);
+  thread_local uint32_t lastColors[pixelClasses];
+  thread_local Palette palette;
+  thread_local bool built = false;
+  if (!built || memcmp(colors, lastColors, sizeof(colors))) {
+    for (int i = 0; i < pixelClasses; i++) {
+      buildRamp(colors[i], config.backgroundColor, palette.rgba + i * 256,
+                palette.steps + i * 256);
+    }
+    memcpy(lastColors, colors, sizeof(colors));
+    built = true;
+  }
+
+  Image image;
+  image.width = map.width;
+  image.height = map.height;
+  image.pixels = new uint8_t[map.width * 4 * map.height];
+  colorKernel()(map.classes.data(), map.coverage.data(),
+                map.width * map.height, palette, image.pixels);
+  return image;
+}
+
+// Returns the layers for this size of symbol and config, drawing them on
+// a miss.  Icons are keyed by path, so a changed file isn't picked up.
+std::shared_ptr<const StaticLayers> Decorator::staticLayers(
+    const Bitmap &bitmap, const Config &config, const char *embed) {
+  static std::mutex mutex;
+  static std::list<std::shared_ptr<const StaticLayers>> entries;
+
+  // Micro QR has no room for an icon.
+  std::string icon = embed != nullptr && !bitmap.micro ? embed : "";
+  std::string key = std::to_string(bitmap.size) + (bitmap.micro ? "m" : "") +
+      ":" + std::to_string(config.scale) + ":" +
+      std::to_string(config.padding) + ":" + std::to_string(config.border) +
+      ":" + std::to_string(static_cast<int>(config.pattern)) + ":" +
+      std::to_string(config.corners) + ":" + icon;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      if ((*it)->key == key) {
+        entries.splice(entries.begin(), entries, it);
+        return entries.front();
+      }
+    }
+  }
+
+  // Draw outside the lock; if another thread drew the same layers in the
+  // meantime, both copies are correct.
+  auto layers = std::make_shared<StaticLayers>();
+  layers->key = key;
+  drawStatic(bitmap, config, icon.empty() ? nullptr : icon.c_str(),
+             layers.get());
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.push_front(layers);
+  if (entries.size() > layerCacheSize) {
+    entries.pop_back();
+  }
+  return layers;
+}
+
+void Decorator::drawStatic(const Bitmap &bitmap, const Config &config,
+                           const char *embed, StaticLayers *layers) {
+  int width = config.scale * bitmap.size + config.padding * 2 + config.border * 2;
+  int height = config.scale * bitmap.size + config.padding * 2 + config.border * 2;
+  CoverageMap &base = layers->base;
+  base.width = width;
+  base.height = height;
+  base.classes.assign(width * height,
+                      static_cast<uint8_t>(PixelClass::Background));
+  base.coverage.assign(width * height, 0);
+
+  // Apply border.
+  int border = config.border;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      if (x < border || x >= width - border ||
+          y < border || y >= height - border) {
+        base.classes[y * width + x] = static_cast<uint8_t>(PixelClass::Border);
+        base.coverage[y * width + x] = fullCoverage;
+      }
+    }
+  }
+
   // add corners.
-  drawPattern(pixels + config.padding * width * 4 + config.padding * 4 + config.border * width * 4 + config.border * 4,
-              width * 4, config.patternColor, config.backgroundColor,
-              config.scale, config.pattern, config.corners);
-  drawPattern(pixels + config.padding * width * 4 + config.padding * 4 + config.border * width * 4 + config.border * 4 +
-              (bitmap.size - 7) * config.scale * 4, width * 4,
-              config.patternColor, config.backgroundColor,
-              config.scale, config.pattern, config.corners);
-  drawPattern(pixels + ((bitmap.size - 7) * config.scale + config.padding + config.border) *
-              width * 4 + config.padding * 4 + config.border * 4, width * 4,
-              config.patternColor, config.backgroundColor,
+  int start = config.padding + config.border;
+  int far = start + (bitmap.size - 7) * config.scale;
+  drawFinder(start, start, config, &base);
+  if (!bitmap.micro) {
+    drawFinder(far, start, config, &base);
+    drawFinder(start, far, config, &base);
+  }
+
+  if (embed != nullptr) {
+    CoverageMap &icon = layers->icon;
+    icon.width = icon.height = (bitmap.size - 16) * config.scale;
+    icon.classes.assign(icon.width * icon.height,
+                        static_cast<uint8_t>(PixelClass::Background));
+    icon.coverage.assign(icon.width * icon.height, 0);
+    embedIcon(embed, &icon);
+  }
+
+  for (uint8_t mask = 0; mask < 16; mask++) {
+    layers->dots[mask].assign(config.scale * config.scale, 0);
+    drawDot(layers->dots[mask].data(), config.scale, config.scale, mask);
+  }
+}
+
+// Draws a finder pattern with its top left corner at x, y.
+void Decorator::drawFinder(int x, int y, const Config &config,
+                           CoverageMap *map) {
+  int size = 7 * config.scale;
+  for (int row = 0; row < size; row++) {
+    memset(map->classes.data() + (y + row) * map->width + x,
+           static_cast<uint8_t>(PixelClass::Pattern), size);
+  }
+  drawPattern(map->coverage.data() + y * map->width + x, map->width,
               config.scale, config.pattern, config.corners);
+}
 
+Image Decorator::compose(const std::vector<Image> &images,
+                         uint32_t background) {
+  // lay the images out in rows, as close to square as we can.
+  int columns = 1;
+  while (columns * columns < static_cast<int>(images.size())) {
+    columns++;
+  }
+  int rows = (images.size() + columns - 1) / columns;
+  int cellWidth = 0;
+  int cellHeight = 0;
+  for (const Image &image : images) {
+    cellWidth = std::max(cellWidth, image.width);
+    cellHeight = std::max(cellHeight, image.height);
+  }
 
-  if (embed != nullptr) {
-    embedIcon(embed, pixels + (8 * config.scale + config.padding + config.border) * width * 4 +
-              (8 * config.scale + config.padding + config.border) * 4, width * 4,
-              config.iconColor, config.backgroundColor,
-              (bitmap.size - 16) * config.scale);
+  Image out;
+  out.width = cellWidth * columns;
+  out.height = cellHeight * rows;
+  out.pixels = new uint8_t[out.width * 4 * out.height];
+  for (int i = 0; i < out.width * out.height; i++) {
+    out.pixels[i * 4] = background >> 16;
+    out.pixels[i * 4 + 1] = (background >> 8) & 0xff;
+    out.pixels[i * 4 + 2] = background & 0xff;
+    out.pixels[i * 4 + 3] = 0xff;  // alpha
   }
+  for (size_t i = 0; i < images.size(); i++) {
+    int x = (i % columns) * cellWidth;
+    int y = (i / columns) * cellHeight;
+    for (int row = 0; row < images[i].height; row++) {
+      memcpy(out.pixels + ((y + row) * out.width + x) * 4,
+             images[i].pixels + row * images[i].width * 4,
+             images[i].width * 4);
+    }
+  }
+  return out;
+}
 
+void Decorator::save(const Image &image, const char *filename,
+                     const bool gray, const unsigned int ppi_x,
+                     const unsigned int ppi_y) {
+  int width = image.width;
+  int height = image.height;
+  uint8_t *pixels = image.pixels;
 
   auto png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr,
                                          nullptr, nullptr);
@@ -168,23 +356,85 @@ void Decorator::decorate(const Bitmap &bitmap, const Config &config,
   fclose(f);
 }
 
-uint32_t Decorator::getColor(uint8_t color, const Config &config) {
+PixelClass Decorator::moduleClass(uint8_t color) {
   switch (color) {
     case Color::Pattern:
-      return config.patternColor;
+      return PixelClass::Pattern;
     case Color::Align:
-      return config.alignColor;
+      return PixelClass::Align;
     case Color::Timing:
     case Color::Reserved:
     case Color::CodeOn:
-      return config.codeColor;
+      return PixelClass::Code;
     default:
-      return config.backgroundColor;
+      return PixelClass::Background;
   }
 }
 
-void Decorator::drawDot(uint8_t *out, int stride, uint32_t color,
-                        uint32_t background, uint32_t scale, uint8_t mask) {
+// Fills colors with the color config paints each class.
+void Decorator::classColors(const Config &config, uint32_t *colors) {
+  colors[static_cast<int>(PixelClass::Background)] = config.backgroundColor;
+  colors[static_cast<int>(PixelClass::Border)] = config.borderColor;
+  colors[static_cast<int>(PixelClass::Pattern)] = config.patternColor;
+  colors[static_cast<int>(PixelClass::Align)] = config.alignColor;
+  colors[static_cast<int>(PixelClass::Code)] = config.codeColor;
+  colors[static_cast<int>(PixelClass::Icon)] = config.iconColor;
+}
+
+// Fills masks with which neighbors each module joins up with: the ones
+// config draws in the same color, limited to the directions the style
+// allows.  The colors only pick the shapes here; recoloring the map later
+// keeps them.
+void Decorator::connectivity(const Bitmap &bitmap, const Config &config,
+                             uint8_t *masks) {
+  uint8_t allowed = 0xf;
+  switch (config.style) {
+    case Style::None:
+      break;
+    case Style::Dots:
+      allowed = 0x0;  // all disconnected
+      break;
+    case Style::HDots:
+      allowed = 0xa;  // no vertical connections
+      break;
+    case Style::VDots:
+      allowed = 0x5;  // no horizontal connections
+      break;
+    case Style::HVDots:  // blend everything
+      break;
+  }
+  int size = bitmap.size;
+  uint32_t colors[pixelClasses];
+  classColors(config, colors);
+  std::vector<uint32_t> keys(size * size);
+  for (int i = 0; i < size * size; i++) {
+    keys[i] = colors[static_cast<int>(moduleClass(bitmap.data[i]))];
+  }
+  int offset = 0;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      uint32_t color = keys[offset];
+      uint8_t mask = 0x0;
+      if (y > 0 && keys[offset - size] == color) {
+        mask |= 0x1;  // above
+      }
+      if (x > 0 && keys[offset - 1] == color) {
+        mask |= 0x2;  // left
+      }
+      if (y < size - 1 && keys[offset + size] == color) {
+        mask |= 0x4;  // below
+      }
+      if (x < size - 1 && keys[offset + 1] == color) {
+        mask |= 0x8;  // right
+      }
+      // unstyled modules are drawn as full squares.
+      masks[offset++] = config.style == Style::None ? 0xf : mask & allowed;
+    }
+  }
+}
+
+void Decorator::drawDot(uint16_t *out, int stride, uint32_t scale,
+                         uint8_t mask) {
   double radius = scale / 2.0;
   double r2 = radius * radius;
   for (int y = 0; y < scale; y++) {
@@ -200,39 +450,33 @@ void Decorator::drawDot(uint8_t *out, int stride, uint32_t color,
       }
 
       if (dist < r2 || skip) {
-        uint32_t newcolor = color;
+        uint16_t level = fullCoverage;
         if (!skip && sqrt(r2) - sqrt(dist) <= 1) {  // antialias
-          newcolor = blend(color, background, sqrt(r2) - sqrt(dist));
+          level = toCoverage(sqrt(r2) - sqrt(dist));
         }
-        out[offset++] = newcolor >> 16;
-        out[offset++] = (newcolor >> 8) & 0xff;
-        out[offset++] = newcolor & 0xff;
-        out[offset++] = 0xff;
-      } else {
-        offset += 4;
+        out[offset] = level;
       }
+      offset++;
     }
   }
 }
 
-void Decorator::drawPattern(uint8_t *out, int stride, uint32_t color,
-                            uint32_t background, uint32_t scale,
-                            PatternStyle style, uint8_t corners) {
+void Decorator::drawPattern(uint16_t *out, int stride, uint32_t scale,
+                             PatternStyle style, uint8_t corners) {
   switch (style) {
     case PatternStyle::None:
-      drawSquare(out, stride, color, background, scale);
+      drawSquare(out, stride, scale);
       break;
     case PatternStyle::Rounded:
-      drawRounded(out, stride, color, background, scale, corners);
+      drawRounded(out, stride, scale, corners);
       break;
     case PatternStyle::Circle:
-      drawCircle(out, stride, color, background, scale);
+      drawCircle(out, stride, scale);
       break;
   }
 }
 
-void Decorator::drawSquare(uint8_t *out, int stride, uint32_t color,
-                           uint32_t background, uint32_t scale) {
+void Decorator::drawSquare(uint16_t *out, int stride, uint32_t scale) {
   double center = (scale * 7.0) / 2.0;
   for (int y = 0; y < 7 * scale; y++) {
     int offset = y * stride;
@@ -241,20 +485,15 @@ void Decorator::drawSquare(uint8_t *out, int stride, uint32_t color,
       double dx = fabs(x - center);
       if ((dx < scale * 1.5 && dy < scale * 1.5) ||
           dx >= scale * 2.5 || dy >= scale * 2.5) {
-        out[offset++] = color >> 16;
-        out[offset++] = (color >> 8) & 0xff;
-        out[offset++] = color & 0xff ;
-        out[offset++] = 0xff;
-      } else {
-        offset += 4;
+        out[offset] = fullCoverage;
       }
+      offset++;
     }
   }
 }
 
-void Decorator::drawRounded(uint8_t *out, int stride, uint32_t color,
-                           uint32_t background, uint32_t scale,
-                           uint8_t corners) {
+void Decorator::drawRounded(uint16_t *out, int stride, uint32_t scale,
+                             uint8_t corners) {
   double radius = (scale - 1) * (scale - 1);
   double radius2 = (scale + 1) * 2 * (scale + 1) * 2;
   double center = (scale * 7.0) / 2.0;
@@ -268,7 +507,7 @@ void Decorator::drawRounded(uint8_t *out, int stride, uint32_t color,
       bool plot = false;
       bool round = false;
       bool arc = false;
-      uint32_t newcolor = color;
+      uint16_t level = fullCoverage;
 
       if ((dx < scale * 1.5 && dy < scale * 1.5) ||
           dx >= scale * 2.5 || dy >= scale * 2.5) {
@@ -319,7 +558,7 @@ void Decorator::drawRounded(uint8_t *out, int stride, uint32_t color,
         if (dist < radius) {
           plot = true;
           if (sqrt(radius) - sqrt(dist) <= 1) {
-            newcolor = blend(color, background, sqrt(radius) - sqrt(dist));
+            level = toCoverage(sqrt(radius) - sqrt(dist));
           }
         }
       }
@@ -329,26 +568,21 @@ void Decorator::drawRounded(uint8_t *out, int stride, uint32_t color,
         if (dist < radius2 && dist >= radius - 0.5) {
           plot = true;
           if (sqrt(radius2) - sqrt(dist) <= 1) {
-            newcolor = blend(color, background, sqrt(radius2) - sqrt(dist));
+            level = toCoverage(sqrt(radius2) - sqrt(dist));
           } else if (sqrt(dist) - sqrt(radius) <= 1) {
-            newcolor = blend(color, background, sqrt(dist) - sqrt(radius));
+            level = toCoverage(sqrt(dist) - sqrt(radius));
           }
         }
       }
       if (plot) {
-        out[offset++] = newcolor >> 16;
-        out[offset++] = (newcolor >> 8) & 0xff;
-        out[offset++] = newcolor & 0xff;
-        out[offset++] = 0xff;
-      } else {
-        offset += 4;
+        out[offset] = level;
       }
+      offset++;
     }
   }
 }
 
-void Decorator::drawCircle(uint8_t *out, int stride, uint32_t color,
-                           uint32_t background, uint32_t scale) {
+void Decorator::drawCircle(uint16_t *out, int stride, uint32_t scale) {
   uint32_t ringOuterRadius = (scale * 7) / 2;
   uint32_t ringInnerRadius = (scale * 5) / 2;
   uint32_t dotRadius = (scale * 3) / 2;
@@ -362,21 +596,17 @@ void Decorator::drawCircle(uint8_t *out, int stride, uint32_t color,
       int dx = x - ringOuterRadius;
       double dist = dx * dx + dy * dy;
       if ((dist < ro2 && dist >= ri2) || dist < dr2) {
-        uint32_t newcolor = color;
+        uint16_t level = fullCoverage;
         if (dist < dr2 && sqrt(dr2) - sqrt(dist) <= 1) {
-          newcolor = blend(color, background, sqrt(dr2) - sqrt(dist));
+          level = toCoverage(sqrt(dr2) - sqrt(dist));
         } else if (dist >= ri2 && sqrt(dist) - sqrt(ri2) <= 1) {
-          newcolor = blend(color, background, sqrt(dist) - sqrt(ri2));
+          level = toCoverage(sqrt(dist) - sqrt(ri2));
         } else if (sqrt(ro2) - sqrt(dist) <= 1) {
-          newcolor = blend(color, background, sqrt(ro2) - sqrt(dist));
+          level = toCoverage(sqrt(ro2) - sqrt(dist));
         }
-        out[offset++] = newcolor >> 16;
-        out[offset++] = (newcolor >> 8) & 0xff;
-        out[offset++] = newcolor & 0xff;
-        out[offset++] = 0xff;
-      } else {
-        offset += 4;
+        out[offset] = level;
       }
+      offset++;
     }
   }
 }
@@ -467,7 +697,41 @@ void Decorator::hsv2rgb(double h, double s, double v,
   }
 }
 
-uint32_t Decorator::blend(uint32_t from, uint32_t to, double ratio) {
+// Fills in every step of the blend from background up to color, as RGBA
+// bytes and as 8.8 fixed point channels.  The ends of the RGBA ramp are
+// exactly the background and the color.
+void Decorator::buildRamp(uint32_t color, uint32_t background,
+                          uint32_t *rgba, uint16_t (*steps)[3]) {
+  for (int i = 0; i < 256; i++) {
+    double rgb[3];
+    blend(color, background, i / 255.0, rgb);
+    uint8_t bytes[4];
+    for (int c = 0; c < 3; c++) {
+      steps[i][c] = static_cast<uint16_t>(rgb[c] * (255 << 8));
+      bytes[c] = steps[i][c] >> 8;
+    }
+    bytes[3] = 0xff;  // alpha
+    uint32_t end = i == 0 ? background : color;
+    if (i == 0 || i == 255) {
+      bytes[0] = end >> 16;
+      bytes[1] = (end >> 8) & 0xff;
+      bytes[2] = end & 0xff;
+    }
+    memcpy(&rgba[i], bytes, 4);
+  }
+}
+
+// The coverage of an anti-aliased pixel ratio of the way into a shape, in
+// 8.8 fixed point steps along a ramp.
+uint16_t Decorator::toCoverage(double ratio) {
+  int position = static_cast<int>(ratio * fullCoverage + 0.5);
+  return std::min(std::max(position, 0), fullCoverage);
+}
+
+// Interpolates from and to through HSV, leaving each channel from 0 to 1
+// in rgb.
+void Decorator::blend(uint32_t from, uint32_t to, double ratio,
+                      double *rgb) {
   double h1,s1,v1, h2,s2,v2;
   rgb2hsv((from >> 16) / 255.0, ((from >> 8) & 0xff) / 255.0,
           (from & 0xff) / 255.0, &h1, &s1, &v1);
@@ -477,15 +741,11 @@ uint32_t Decorator::blend(uint32_t from, uint32_t to, double ratio) {
   h = h1 * ratio + h2 * (1 - ratio);
   s = s1 * ratio + s2 * (1 - ratio);
   v = v1 * ratio + v2 * (1 - ratio);
-  double r, g, b;
-  hsv2rgb(h, s, v, &r, &g, &b);
-  return (static_cast<int>(r * 255) << 16) |
-      (static_cast<int>(g * 255) << 8) |
-      static_cast<int>(b * 255);
+  hsv2rgb(h, s, v, &rgb[0], &rgb[1], &rgb[2]);
 }
 
-void Decorator::embedIcon(const char *embed, uint8_t *out, int stride,
-                          uint32_t color, uint32_t background, uint32_t scale) {
+void Decorator::embedIcon(const char *embed, CoverageMap *icon) {
+  int scale = icon->width;
   auto png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr,
                                         nullptr, nullptr);
   auto info_ptr = png_create_info_struct(png_ptr);
@@ -534,23 +794,17 @@ void Decorator::embedIcon(const char *embed, uint8_t *out, int stride,
   fclose(f);
 
   double xlate = (double)width / scale;
-  printf("width: %d, height: %d, xlate: %f, scale: %d\n",
-         width, height, xlate, scale);
 
   for (int y = 0; y < scale; y++) {
     int src = (int)(y * xlate) * rowbytes;
-    int dest = y * stride;
+    int dest = y * scale;
     for (int x = 0; x < scale; x++) {
       int sx = (int)(x * xlate) * 4;
       if (imagedata[src + sx + 3] == 0xff) {
-        uint32_t c = blend(color, background, imagedata[src + sx] / 255.0);
-        out[dest++] = c >> 16;
-        out[dest++] = (c >> 8) & 0xff;
-        out[dest++] = c & 0xff;
-        out[dest++] = 0xff;
-      } else {
-        dest += 4;
+        icon->classes[dest] = static_cast<uint8_t>(PixelClass::Icon);
+        icon->coverage[dest] = imagedata[src + sx] << 8;
       }
+      dest++;
     }
   }
   delete [] imagedata;
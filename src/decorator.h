@@ -3,28 +3,100 @@
 #include "qrgrid.h"
 #include "config.h"
 #include "colors.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Image {
+  uint8_t *pixels = nullptr;  // RGBA
+  int width = 0;
+  int height = 0;
+};
+
+// What is drawn at a pixel, which picks its color from the config.
+enum class PixelClass : uint8_t {
+  Background,
+  Border,
+  Pattern,
+  Align,
+  Code,
+  Icon,
+};
+#define pixelClasses 6
+
+// Coverage of a pixel the shape fills, in 8.8 fixed point steps along the
+// ramp from background to color.
+#define fullCoverage (255 << 8)
+
+// A rendered code before it's colored: for each pixel its class, and how
+// much of the pixel the shape covers, from 0 for bare background to
+// fullCoverage.  Edges keep a fraction of a step, so coloring them lands
+// within one step of blending the colors directly.
+struct CoverageMap {
+  std::vector<uint8_t> classes;
+  std::vector<uint16_t> coverage;
+  int width = 0;
+  int height = 0;
+};
+
+// Everything in a render that doesn't depend on the message or colors:
+// background, border and finder patterns, the scaled icon, and the dot
+// for each neighbor mask.  Renders of one size and style start from a
+// copy of base.
+struct StaticLayers {
+  std::string key;
+  CoverageMap base;
+  CoverageMap icon;  // Background where the modules show through
+  std::vector<uint16_t> dots[16];  // scale x scale coverage, by mask
+};
+
+// How many sizes and styles keep their static layers.
+#define layerCacheSize 16
 
 class Decorator {
  public:
   static void decorate(const Bitmap &bitmap, const Config &config,
                        const char *embed, const char *filename, const bool gray, const unsigned int ppi_x, const unsigned int ppi_y);
+  static Image render(const Bitmap &bitmap, const Config &config,
+                      const char *embed);
+  // The two halves of render.  rasterize draws the shapes, with modules
+  // joining neighbors that config draws in the same color, and colorize
+  // paints them in one pass.  A code can be recolored without drawing it
+  // again, but it keeps the shapes its rasterize config picked.
+  static CoverageMap rasterize(const Bitmap &bitmap, const Config &config,
+                               const char *embed);
+  static Image colorize(const CoverageMap &map, const Config &config);
+  // Tiles images into one, padding with the background color.
+  static Image compose(const std::vector<Image> &images,
+                       uint32_t background);
+  // Writes image as a PNG.  Gray output is converted in place.
+  static void save(const Image &image, const char *filename, const bool gray,
+                   const unsigned int ppi_x, const unsigned int ppi_y);
 
  private:
-  static uint32_t getColor(uint8_t color, const Config &config);
-  static void embedIcon(const char *embed, uint8_t *out, int stride,
-                        uint32_t color, uint32_t background, uint32_t scale);
-  static void drawDot(uint8_t *out, int stride, uint32_t color,
-                      uint32_t background, uint32_t scale, uint8_t mask);
-  static void drawPattern(uint8_t *out, int stride, uint32_t color,
-                          uint32_t background, uint32_t scale,
-                          PatternStyle style, uint8_t corners);
-  static void drawSquare(uint8_t *out, int stride, uint32_t color,
-                         uint32_t background, uint32_t scale);
-  static void drawRounded(uint8_t *out, int stride, uint32_t color,
-                          uint32_t background, uint32_t scale, uint8_t corners);
-  static void drawCircle(uint8_t *out, int stride, uint32_t color,
-                          uint32_t background, uint32_t scale);
-  static uint32_t blend(uint32_t from, uint32_t to, double ratio);
+  static PixelClass moduleClass(uint8_t color);
+  static void classColors(const Config &config, uint32_t *colors);
+  static void embedIcon(const char *embed, CoverageMap *icon);
+  static void connectivity(const Bitmap &bitmap, const Config &config,
+                           uint8_t *masks);
+  static std::shared_ptr<const StaticLayers> staticLayers(
+      const Bitmap &bitmap, const Config &config, const char *embed);
+  static void drawStatic(const Bitmap &bitmap, const Config &config,
+                         const char *embed, StaticLayers *layers);
+  static void drawFinder(int x, int y, const Config &config,
+                         CoverageMap *map);
+  static void drawDot(uint16_t *out, int stride, uint32_t scale,
+                       uint8_t mask);
+  static void drawPattern(uint16_t *out, int stride, uint32_t scale,
+                           PatternStyle style, uint8_t corners);
+  static void drawSquare(uint16_t *out, int stride, uint32_t scale);
+  static void drawRounded(uint16_t *out, int stride, uint32_t scale,
+                           uint8_t corners);
+  static void drawCircle(uint16_t *out, int stride, uint32_t scale);
+  static void buildRamp(uint32_t color, uint32_t background,
+                        uint32_t *rgba, uint16_t (*steps)[3]);
+  static uint16_t toCoverage(double ratio);
+  static void blend(uint32_t from, uint32_t to, double ratio, double *rgb);
   static void rgb2hsv(double r, double g, double b,
                       double *h, double *s, double *v);
   static void hsv2rgb(double h, double s, double v,
@@ -0,0 +1,74 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#pragma once
+
+#include <cstdint>
+
+// The largest number of EC codewords per block any QR version uses.
+#define maxECPerBlock 30
+
+// Log and antilog tables for GF(256) with the QR primitive polynomial
+// x^8 + x^4 + x^3 + x^2 + 1.  exp[] is doubled so exp[log[a] + log[b]]
+// never needs a modulo.
+struct GaloisField {
+  uint8_t exp[512];
+  uint8_t log[256];
+
+  constexpr GaloisField() : exp(), log() {
+    int value = 1;
+    for (int i = 0; i < 255; i++) {
+      exp[i] = value;
+      exp[i + 255] = value;
+      log[value] = i;
+      value <<= 1;
+      if (value & 0x100) {
+        value ^= 0x11d;
+      }
+    }
+    exp[510] = exp[0];
+    exp[511] = exp[1];
+  }
+
+  constexpr uint8_t mul(uint8_t a, uint8_t b) const {
+    return (a && b) ? exp[log[a] + log[b]] : 0;
+  }
+};
+
+static constexpr GaloisField gf;
+
+// Generator polynomials (x - a^0)(x - a^1)...(x - a^(n-1)) for every
+// n up to maxECPerBlock.  poly[n][k] is the coefficient of x^k.
+struct Generators {
+  uint8_t poly[maxECPerBlock + 1][maxECPerBlock + 1];
+
+  constexpr Generators() : poly() {
+    poly[0][0] = 1;
+    for (int n = 1; n <= maxECPerBlock; n++) {
+      uint8_t root = gf.exp[n - 1];
+      poly[n][0] = gf.mul(poly[n - 1][0], root);
+      for (int k = 1; k <= n; k++) {
+        poly[n][k] = poly[n - 1][k - 1] ^ gf.mul(poly[n - 1][k], root);
+      }
+    }
+  }
+};
+
+static constexpr Generators generators;
+
+// Split-nibble product tables for the SIMD Reed-Solomon kernels.
+// mul[t][n] is t * n and mul[t][16 + n] is t * (n << 4), so the product
+// of t and any byte b is mul[t][b & 0xf] ^ mul[t][16 + (b >> 4)].
+struct NibbleTables {
+  uint8_t mul[256][32];
+
+  constexpr NibbleTables() : mul() {
+    for (int t = 0; t < 256; t++) {
+      for (int n = 0; n < 16; n++) {
+        mul[t][n] = gf.mul(t, n);
+        mul[t][16 + n] = gf.mul(t, n << 4);
+      }
+    }
+  }
+};
+
+alignas(32) static constexpr NibbleTables nibbleTables;
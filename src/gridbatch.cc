@@ -0,0 +1,159 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#include "qrgrid.h"
+#include "bitlines.h"
+#include <cstring>
+#include <algorithm>
+
+// batchLanes packed symbols, with word w of line i of symbol s in
+// rows[i][w][s].
+struct LaneGrid {
+  int size;
+  LaneWords rows[maxGridSize][gridWords];
+  LaneWords cols[maxGridSize][gridWords];
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#endif
+
+typedef void (*LaneKernel)(const LaneGrid &base, const BitGrid &mask,
+                           LaneGrid *masked, int *penalties);
+
+// Fills penalties with the full penalty of each lane of base once mask is
+// applied, building the masked symbols in masked.
+static inline __attribute__((always_inline))
+void scoreLanesBody(const LaneGrid &base, const BitGrid &mask,
+                    LaneGrid *masked, int *penalties) {
+  int size = base.size;
+  for (int i = 0; i < size; i++) {
+    for (int w = 0; w < gridWords; w++) {
+      masked->rows[i][w] = base.rows[i][w] ^ mask.rows[i][w];
+      masked->cols[i][w] = base.cols[i][w] ^ mask.cols[i][w];
+    }
+  }
+  LaneWords runs = {}, blocks = {}, matches = {}, dark = {};
+  LaneWords valid[gridWords];
+  lowBits(size - 1, valid);
+  for (int i = 0; i < size; i++) {
+    runPenalty(masked->rows[i], size, &runs);
+    runPenalty(masked->cols[i], size, &runs);
+    finderCount(masked->rows[i], size, &matches);
+    finderCount(masked->cols[i], size, &matches);
+    countLine(masked->rows[i], &dark);
+    if (i + 1 < size) {
+      blockCount(masked->rows[i], masked->rows[i + 1], valid, &blocks);
+    }
+  }
+  for (int s = 0; s < batchLanes; s++) {
+    penalties[s] = runs[s] + blocks[s] * 3 + matches[s] * 40 +
+        darkPenalty(dark[s], size);
+  }
+}
+
+static void scoreLanesScalar(const LaneGrid &base, const BitGrid &mask,
+                             LaneGrid *masked, int *penalties) {
+  scoreLanesBody(base, mask, masked, penalties);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// The same body, with each LaneWords op in two 256-bit or one 512-bit
+// register.
+__attribute__((target("avx2,popcnt")))
+static void scoreLanesAVX2(const LaneGrid &base, const BitGrid &mask,
+                           LaneGrid *masked, int *penalties) {
+  scoreLanesBody(base, mask, masked, penalties);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void scoreLanesAVX512(const LaneGrid &base, const BitGrid &mask,
+                             LaneGrid *masked, int *penalties) {
+  scoreLanesBody(base, mask, masked, penalties);
+}
+
+#endif  // HAVE_X86_KERNELS
+
+static LaneKernel laneKernel() {
+  static const LaneKernel kernel = [] {
+    LaneKernel k = scoreLanesScalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+      k = scoreLanesAVX2;
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vpopcntdq")) {
+      k = scoreLanesAVX512;
+    }
+#endif
+    return k;
+  }();
+  return kernel;
+}
+
+std::vector<Bitmap> QRGrid::generateBatch(
+    const std::vector<Message> &messages) {
+  std::vector<Bitmap> bitmaps(messages.size());
+  std::vector<size_t> versions[40];
+  for (size_t i = 0; i < messages.size(); i++) {
+    if (messages[i].micro || maskMode != MaskMode::Optimal || maskBudget) {
+      bitmaps[i] = generate(messages[i]);
+    } else {
+      versions[messages[i].version - 1].push_back(i);
+    }
+  }
+
+  // lanes 0 holds the unmasked symbols and lanes 1 each masked candidate.
+  LaneGrid *lanes = new LaneGrid[2];
+  BitGrid *packed = new BitGrid();
+  for (int v = 0; v < 40; v++) {
+    const std::vector<size_t> &group = versions[v];
+    if (group.empty()) {
+      continue;
+    }
+    const GridTemplate &grid = getTemplate(v + 1, false);
+    for (size_t first = 0; first < group.size(); first += batchLanes) {
+      int count = std::min<size_t>(batchLanes, group.size() - first);
+      LaneGrid &base = lanes[0];
+      memset(&base, 0, sizeof(LaneGrid));
+      base.size = grid.size;
+      for (int s = 0; s < count; s++) {
+        size_t i = group[first + s];
+        bitmaps[i] = placeData(messages[i], grid);
+        *packed = BitGrid();
+        packGrid(bitmaps[i], packed);
+        for (int j = 0; j < grid.size; j++) {
+          for (int w = 0; w < gridWords; w++) {
+            base.rows[j][w][s] = packed->rows[j][w];
+            base.cols[j][w][s] = packed->cols[j][w];
+          }
+        }
+      }
+
+      int penalties[8][batchLanes];
+      LaneKernel scoreLanes = laneKernel();
+      for (int m = 0; m < 8; m++) {
+        scoreLanes(base, grid.masks[m], &lanes[1], penalties[m]);
+      }
+      for (int s = 0; s < count; s++) {
+        int lowestMask = 0;
+        for (int m = 1; m < 8; m++) {
+          if (penalties[m][s] < penalties[lowestMask][s]) {
+            lowestMask = m;
+          }
+        }
+        size_t i = group[first + s];
+        applyMask(grid.masks[lowestMask], &bitmaps[i]);
+        finishSymbol(messages[i], lowestMask, &bitmaps[i]);
+        maskStats.candidates += 8;
+        lastMask = MaskChoice();
+        lastMask.mask = lowestMask;
+        lastMask.penalty = penalties[lowestMask][s];
+      }
+    }
+  }
+  delete packed;
+  delete [] lanes;
+  return bitmaps;
+}
@@ -9,4 +9,5 @@ struct Message {
   uint8_t *data = nullptr;
   int version = 0;
   uint8_t ecl = 0;
+  bool micro = false;  // version is M1 to M4
 };
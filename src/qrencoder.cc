@@ -2,50 +2,74 @@
 
 #include "qrencoder.h"
 #include "tables.h"
+#include "reedsolomon.h"
+#include "galois.h"
 #include <cstring>
+#include <algorithm>
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-QREncoder::QREncoder() {
-  uint8_t pinit = 0, p1 = 1, p2 = 0, p3 = 0,
-          p4 = 0, p5 = 0, p6 = 0, p7 = 0, p8 = 0;
-  gexp[0] = 1;
-  gexp[255] = 1;
-  glog[0] = 0;
-  for (int i = 1; i < 256; i++) {
-    pinit = p8;
-    p8 = p7;
-    p7 = p6;
-    p6 = p5;
-    p5 = p4 ^ pinit;
-    p4 = p3 ^ pinit;
-    p3 = p2 ^ pinit;
-    p2 = p1;
-    p1 = pinit;
-    gexp[i] = p1 + p2 * 2 + p3 * 4 + p4 * 8 + p5 * 16 + p6 * 32 + p7 * 64 +
-        p8 * 128;
-    gexp[i + 255] = gexp[i];
-  }
-  for (int i = 1; i < 256; i++) {
-    for (int z = 0; z < 256; z++) {
-      if (gexp[z] == i) {
-        glog[i] = z;
-        break;
-      }
-    }
+// ECI assignment number for UTF-8.
+static const int utf8Designator = 26;
+// mode, symbol index, symbol count and parity.
+static const int appendHeaderBits = 20;
+// the most symbols a Structured Append sequence can have.
+static const int maxAppendSymbols = 16;
+
+// Micro QR versions are passed around as -1 through -4, with mode
+// indicators of 0 to 3 bits.
+static int modeLength(int version) {
+  return version < 0 ? -version - 1 : 4;
+}
+
+static int modeIndicator(int version, Encoding encoding) {
+  if (version > 0) {
+    return encoding;
   }
+  switch (encoding) {
+    case Encoding::Alpha:
+      return 1;
+    case Encoding::Byte:
+      return 2;
+    case Encoding::Kanji:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+Message QREncoder::encode(std::string_view msg, ECL ecl) {
+  uint8_t *buffer = new uint8_t[maxMessageBytes];
+  Message message = encode(msg, ecl, buffer);
+  if (message.data == nullptr) {
+    delete [] buffer;
+  }
+  return message;
+}
+
+Message QREncoder::encode(std::string_view msg, ECL ecl, uint8_t *buffer) {
+  return encode({ msg, 0, 1, 0 }, ecl, buffer);
 }
 
-Message QREncoder::encode(std::string msg, ECL ecl) {
+Message QREncoder::encode(const AppendPart &part, ECL ecl,
+                          uint8_t *buffer) {
   Message message;
 
-  Encoding encoding = determineEncoding(msg);
-  int version = determineVersion(msg.length(), encoding, ecl);
+  std::string_view msg = part.data;
+  if (allowMicro && part.total == 1 && encodeMicro(msg, ecl, buffer,
+                                                   &message)) {
+    return message;
+  }
+  int headerBits = part.total > 1 ? appendHeaderBits : 0;
+  int version = determineVersion(msg, ecl, headerBits, &scratchSegments);
   if (version < 0) {
-    std::cerr << "Message is too long.  We don't support larger QR codes"
-              << std::endl;
+    std::cerr << "Message is too long to fit in a QR code" << std::endl;
     return message;
   }
-  ecl = determineOptimumECL(ecl, msg.length(), encoding, version);
+  ecl = determineOptimumECL(ecl,
+      segmentBits(scratchSegments, version) + headerBits, version);
 
   int ecPerBlock = 0;
   int g1Blocks = 0;
@@ -56,127 +80,615 @@ Message QREncoder::encode(std::string msg, ECL ecl) {
                      &g2Blocks, &g2DataPerBlock);
 
   BitStream stream;
-  int totalData = g1Blocks * g1DataPerBlock + g2Blocks + g2DataPerBlock;
-  stream.data = new uint8_t[totalData];
-  memset(stream.data, 0, totalData);
+  int totalData = g1Blocks * g1DataPerBlock + g2Blocks * g2DataPerBlock;
+  stream.data = scratchCodewords;
+  stream.capacity = totalData;
 
-  // add mode indicator
-  stream.write(encoding, 4);
-  stream.write(msg.length(), determineCCILength(version, encoding));
-  switch (encoding) {
-    case Encoding::Numeric:
-      encodeNumeric(msg, &stream);
-      break;
-    case Encoding::Alpha:
-      encodeAlpha(msg, &stream);
-      break;
-    case Encoding::Byte:
-      encodeByte(msg, &stream);
-      break;
+  if (part.total > 1) {
+    stream.write(Encoding::StructuredAppend, 4);
+    stream.write(part.index, 4);
+    stream.write(part.total - 1, 4);
+    stream.write(part.parity, 8);
+  }
+  writeSegments(msg, scratchSegments, version, &stream, nullptr);
+  stream.padToCapacity();
+  if (stream.overflow) {
+    std::cerr << "Encoded message overflowed its symbol" << std::endl;
+    return message;
   }
-  stream.padToCapacity(totalData);
 
+  // each block is a run of the codewords, so point at them in place.
   int numBlocks = g1Blocks + g2Blocks;
-  Block *blocks = new Block[numBlocks];
-  for (int i = 0; i < g1Blocks; i++) {
-    blocks[i].dataLen = g1DataPerBlock;
-    blocks[i].data = new uint8_t[g1DataPerBlock];
-    memcpy(blocks[i].data, stream.data + i * g1DataPerBlock, g1DataPerBlock);
-    blocks[i].ec = new uint8_t[ecPerBlock];
-    memset(blocks[i].ec, 0, ecPerBlock);
-  }
-  for (int i = 0; i < g2Blocks; i++) {
-    blocks[g1Blocks + i].dataLen = g2DataPerBlock;
-    blocks[g1Blocks + i].data = new uint8_t[g2DataPerBlock];
-    memcpy(blocks[g1Blocks + i].data, stream.data +
-           g1Blocks * g1DataPerBlock + i * g2DataPerBlock, g2DataPerBlock);
-    blocks[g1Blocks + i].ec = new uint8_t[ecPerBlock];
-    memset(blocks[g1Blocks + i].ec, 0, ecPerBlock);
-  }
-
-  delete [] stream.data;
-
-  message.length = 0;
-  for (int i = 0; i < g1Blocks + g2Blocks; i++) {
-    reedSolomon(blocks[i].data, ecPerBlock, blocks[i].dataLen, blocks[i].ec);
-    message.length += blocks[i].dataLen + ecPerBlock;
-  }
-
-  message.data = new uint8_t[message.length + 1];
-  memset(message.data, 0, message.length + 1);
-  int dataLen = g1DataPerBlock > g2DataPerBlock ? g1DataPerBlock :
-      g2DataPerBlock;
+  uint8_t *data = scratchCodewords;
+  for (int i = 0; i < numBlocks; i++) {
+    scratchBlocks[i].dataLen = i < g1Blocks ? g1DataPerBlock : g2DataPerBlock;
+    scratchBlocks[i].data = data;
+    scratchBlocks[i].ec = scratchEC + i * ecPerBlock;
+    data += scratchBlocks[i].dataLen;
+  }
+  memset(scratchEC, 0, numBlocks * ecPerBlock);
+  ReedSolomon::encode(scratchBlocks, numBlocks, ecPerBlock);
+
+  interleave(scratchBlocks, numBlocks, ecPerBlock, buffer);
+  message.data = buffer;
+  message.length = (totalData + numBlocks * ecPerBlock) * 8;
+
+  message.version = version;
+  message.ecl = ecl;
+  message.length += remainderBits[version - 1];
+
+  return message;
+}
+
+void QREncoder::interleave(const Block *blocks, int numBlocks,
+                           int ecPerBlock, uint8_t *out) {
+  uint32_t dataLen = 0;
+  for (int j = 0; j < numBlocks; j++) {
+    if (blocks[j].dataLen > dataLen) {
+      dataLen = blocks[j].dataLen;
+    }
+  }
   int pos = 0;
-  for (int i = 0; i < dataLen; i++) {
+  for (uint32_t i = 0; i < dataLen; i++) {
     for (int j = 0; j < numBlocks; j++) {
       if (i < blocks[j].dataLen) {
-        message.data[pos++] = blocks[j].data[i];
+        out[pos++] = blocks[j].data[i];
       }
     }
   }
   for (int i = 0; i < ecPerBlock; i++) {
     for (int j = 0; j < numBlocks; j++) {
-      message.data[pos++] = blocks[j].ec[i];
+      out[pos++] = blocks[j].ec[i];
     }
   }
-  message.data[pos++] = 0;  // pad with a 0
+  out[pos++] = 0;  // pad with a 0
+}
 
-  for (int i = 0; i < numBlocks; i++) {
-    delete [] blocks[i].data;
-    delete [] blocks[i].ec;
+void QREncoder::writeSegments(std::string_view msg,
+                              const std::vector<Segment> &segments,
+                              int version, BitStream *stream,
+                              std::vector<uint32_t> *dataOffsets) {
+  for (const Segment &segment : segments) {
+    // add mode indicator
+    stream->write(modeIndicator(version, segment.encoding),
+                  modeLength(version));
+    if (segment.encoding == Encoding::ECI) {
+      stream->write(utf8Designator, 8);
+      if (dataOffsets) {
+        dataOffsets->push_back(stream->bitLength());
+      }
+      continue;
+    }
+    stream->write(segment.length,
+                  determineCCILength(version, segment.encoding));
+    if (dataOffsets) {
+      dataOffsets->push_back(stream->bitLength());
+    }
+    std::string_view part = msg.substr(segment.start,
+        segment.encoding == Encoding::Kanji ? segment.length * 2 :
+        segment.length);
+    switch (segment.encoding) {
+      case Encoding::Numeric:
+        encodeNumeric(part, stream);
+        break;
+      case Encoding::Alpha:
+        encodeAlpha(part, stream);
+        break;
+      case Encoding::Byte:
+        encodeByte(part, stream);
+        break;
+      case Encoding::Kanji:
+        encodeKanji(part, stream);
+        break;
+      case Encoding::StructuredAppend:
+      case Encoding::ECI:
+        break;
+    }
   }
-  message.length *= 8;
+}
 
-  message.version = version;
-  message.ecl = ecl;
-  if (version > 1) {
-    message.length += 7;  // 7 padding bits
+// Character classes, as bits so the classes of a whole message can be
+// and-ed or or-ed together.
+enum CharClass {
+  ClassNumeric = 1,
+  ClassAlpha = 2,
+  ClassHigh = 4,  // not ASCII
+};
+
+// Per-byte alphanumeric values (0xff outside the set) and classes.
+struct CharTables {
+  uint8_t alpha[256];
+  uint8_t classes[256];
+
+  constexpr CharTables() : alpha(), classes() {
+    const char *chars = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+    for (int c = 0; c < 256; c++) {
+      alpha[c] = 0xff;
+      classes[c] = c & 0x80 ? ClassHigh : 0;
+    }
+    for (int i = 0; i < 45; i++) {
+      uint8_t c = chars[i];
+      alpha[c] = i;
+      classes[c] = i < 10 ? ClassNumeric | ClassAlpha : ClassAlpha;
+    }
   }
+};
 
-  return message;
+static constexpr CharTables charTables;
+
+static int alphaValue(char c) {
+  return charTables.alpha[static_cast<uint8_t>(c)];
+}
+
+#ifdef __SSE2__
+// true in every lane where lo <= c <= hi.  The compares are signed, which
+// is fine since none of the ranges reach past 0x7f.
+static inline __m128i inRange(__m128i c, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+}
+#endif
+
+// Fills in the class of every byte of msg, along with the classes every
+// byte shares and the classes any byte has.
+static void classify(std::string_view msg, uint8_t *classes, uint8_t *all,
+                     uint8_t *any) {
+  uint8_t shared = 0xff, seen = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i sharedLanes = _mm_set1_epi8(-1);
+  __m128i seenLanes = _mm_setzero_si128();
+  for (; i + 16 <= msg.length(); i += 16) {
+    __m128i c = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(msg.data() + i));
+    __m128i digit = inRange(c, '0', '9');
+    // the rest of the alphanumeric set is A-Z and " $%*+-./:"
+    __m128i alpha = _mm_or_si128(
+        _mm_or_si128(inRange(c, 'A', 'Z'), inRange(c, '0', ':')),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                  inRange(c, '$', '%')),
+                     _mm_or_si128(inRange(c, '*', '+'),
+                                  inRange(c, '-', '/'))));
+    __m128i lanes = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(ClassNumeric)),
+                     _mm_and_si128(alpha, _mm_set1_epi8(ClassAlpha))),
+        _mm_and_si128(_mm_cmplt_epi8(c, _mm_setzero_si128()),
+                      _mm_set1_epi8(ClassHigh)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(classes + i), lanes);
+    sharedLanes = _mm_and_si128(sharedLanes, lanes);
+    seenLanes = _mm_or_si128(seenLanes, lanes);
+  }
+  alignas(16) uint8_t lanes[32];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), sharedLanes);
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes + 16), seenLanes);
+  for (int j = 0; j < 16; j++) {
+    shared &= lanes[j];
+    seen |= lanes[16 + j];
+  }
+#endif
+  for (; i < msg.length(); i++) {
+    classes[i] = charTables.classes[static_cast<uint8_t>(msg[i])];
+    shared &= classes[i];
+    seen |= classes[i];
+  }
+  *all = shared;
+  *any = seen;
 }
 
-Encoding QREncoder::determineEncoding(std::string msg) {
-  bool canNumeric = true, canAlpha = true;
-  for (int i = 0; i < msg.length(); i++) {
-    if (msg[i] < '0' || msg[i] > '9') {
-      canNumeric = false;
+// Shift-JIS double byte characters that Kanji mode can hold.
+static bool isKanji(uint8_t hi, uint8_t lo) {
+  uint16_t c = (hi << 8) | lo;
+  return lo >= 0x40 && lo <= 0xfc && lo != 0x7f &&
+      ((c >= 0x8140 && c <= 0x9ffc) || (c >= 0xe040 && c <= 0xebbf));
+}
+
+static bool isUTF8(std::string_view msg) {
+  for (size_t i = 0; i < msg.length(); ) {
+    uint8_t c = msg[i];
+    int extra = c < 0x80 ? 0 : (c & 0xe0) == 0xc0 ? 1 :
+        (c & 0xf0) == 0xe0 ? 2 : (c & 0xf8) == 0xf0 ? 3 : -1;
+    if (extra < 0 || i + extra >= msg.length()) {
+      return false;
     }
-    if ((msg[i] < '0' || msg[i] > '9') &&
-        (msg[i] < 'A' || msg[i] > 'Z') &&
-        strchr(" $%*+-./:", msg[i]) == nullptr) {
-      canAlpha = false;
+    for (int j = 1; j <= extra; j++) {
+      if ((msg[i + j] & 0xc0) != 0x80) {
+        return false;
+      }
     }
+    i += extra + 1;
   }
-  return canNumeric ? Encoding::Numeric :
-      canAlpha ? Encoding::Alpha : Encoding::Byte;
+  return true;
 }
 
-int QREncoder::determineVersion(int length, Encoding encoding, ECL ecl) {
-  for (int i = 0; i < numModes; i++) {
-    if (modes[i].ecl == ecl &&
-        ((encoding == Encoding::Numeric && length <= modes[i].numericMax) ||
-         (encoding == Encoding::Alpha && length <= modes[i].alphaMax) ||
-         (encoding == Encoding::Byte && length <= modes[i].byteMax))) {
-      return modes[i].version;
+// Segmenter states.  Numeric and alpha pack characters in groups, so the
+// cost of the next character depends on how many are already pending.
+enum SegmentState {
+  Numeric0 = 0,
+  Numeric1,
+  Numeric2,
+  Alpha0,
+  Alpha1,
+  Byte0,
+  Kanji0,
+  NumStates,
+};
+
+static const Encoding stateEncoding[] = {
+  Encoding::Numeric, Encoding::Numeric, Encoding::Numeric,
+  Encoding::Alpha, Encoding::Alpha, Encoding::Byte, Encoding::Kanji,
+};
+// bits added by one more character in this state, and the state after it.
+static const int stateBits[] = { 4, 3, 3, 6, 5, 8, 13 };
+static const SegmentState stateNext[] = {
+  Numeric1, Numeric2, Numeric0, Alpha1, Alpha0, Byte0, Kanji0,
+};
+// bytes of input one character takes.
+static const int stateWidth[] = { 1, 1, 1, 1, 1, 1, 2 };
+
+void QREncoder::determineSegments(std::string_view msg,
+                                  const uint8_t *classes, uint8_t all,
+                                  uint8_t any, int version,
+                                  std::vector<Segment> *segments) {
+  int length = msg.length();
+  segments->clear();
+  if (length == 0) {
+    segments->push_back({ Encoding::Numeric, 0, 0 });
+    return;
+  }
+  // all digits, or plain text with nothing numeric or alphanumeric, can
+  // only be one segment.
+  if (all & ClassNumeric) {
+    segments->push_back({ Encoding::Numeric, 0, length });
+    return;
+  }
+  if (any == 0 && determineCCILength(version, Encoding::Byte) > 0) {
+    segments->push_back({ Encoding::Byte, 0, length });
+    return;
+  }
+  // UTF-8 gets an ECI header; anything else non-ASCII is taken to be
+  // Shift-JIS, so double byte characters can use Kanji mode.
+  bool ascii = !(any & ClassHigh);
+  bool utf8 = !ascii && isUTF8(msg);
+  bool sjis = !ascii && !utf8;
+
+  // the smaller Micro QR versions lack some modes.
+  int header[NumStates];
+  bool available[NumStates];
+  for (int s = 0; s < NumStates; s++) {
+    int cci = determineCCILength(version, stateEncoding[s]);
+    header[s] = modeLength(version) + cci;
+    available[s] = cci > 0;
+  }
+
+  // cost[i * NumStates + s] is the fewest bits that encode the first i
+  // bytes and leave us in state s.  from[] remembers the previous state.
+  // Both live in the encoder so repeat encodes don't allocate.
+  const int unreachable = 0x7fffffff;
+  scratchCost.assign((length + 1) * NumStates, unreachable);
+  scratchFrom.resize((length + 1) * NumStates);
+  int *cost = scratchCost.data();
+  uint8_t *from = scratchFrom.data();
+  for (int i = 0; i < length; i++) {
+    bool allowed[NumStates];
+    for (int s = 0; s < NumStates; s++) {
+      switch (stateEncoding[s]) {
+        case Encoding::Numeric:
+          allowed[s] = classes[i] & ClassNumeric;
+          break;
+        case Encoding::Alpha:
+          allowed[s] = classes[i] & ClassAlpha;
+          break;
+        case Encoding::Byte:
+          allowed[s] = true;
+          break;
+        case Encoding::Kanji:
+          allowed[s] = sjis && i + 1 < length && isKanji(msg[i], msg[i + 1]);
+          break;
+        case Encoding::StructuredAppend:
+        case Encoding::ECI:
+          allowed[s] = false;
+          break;
+      }
+      allowed[s] = allowed[s] && available[s];
+    }
+    // the first character has nothing before it, so only try once.
+    for (int s = 0; s < (i == 0 ? 1 : NumStates); s++) {
+      int bits = i == 0 ? 0 : cost[i * NumStates + s];
+      if (bits == unreachable) {
+        continue;
+      }
+      // start a new segment (always the case for the first character)
+      for (SegmentState start : { Numeric0, Alpha0, Byte0, Kanji0 }) {
+        if (!allowed[start] ||
+            (i > 0 && stateEncoding[start] == stateEncoding[s])) {
+          continue;
+        }
+        int to = (i + stateWidth[start]) * NumStates + stateNext[start];
+        if (bits + header[start] + stateBits[start] < cost[to]) {
+          cost[to] = bits + header[start] + stateBits[start];
+          from[to] = s;
+        }
+      }
+      // or extend the current one
+      if (i > 0 && allowed[s]) {
+        int to = (i + stateWidth[s]) * NumStates + stateNext[s];
+        if (bits + stateBits[s] < cost[to]) {
+          cost[to] = bits + stateBits[s];
+          from[to] = s;
+        }
+      }
+    }
+  }
+
+  int state = 0;
+  for (int s = 1; s < NumStates; s++) {
+    if (cost[length * NumStates + s] < cost[length * NumStates + state]) {
+      state = s;
+    }
+  }
+  if (cost[length * NumStates + state] == unreachable) {
+    return;  // a mode we need isn't available
+  }
+  // walk back, merging runs of the same encoding into segments.
+  for (int i = length; i > 0; ) {
+    Encoding encoding = stateEncoding[state];
+    int prev = from[i * NumStates + state];
+    i -= stateWidth[state];
+    if (segments->empty() || segments->back().encoding != encoding) {
+      segments->push_back({ encoding, i, 0 });
+    }
+    segments->back().start = i;
+    segments->back().length++;
+    state = prev;
+  }
+  if (utf8) {
+    segments->push_back({ Encoding::ECI, 0, 0 });
+  }
+  std::reverse(segments->begin(), segments->end());
+}
+
+// bits used by a trailing group of 0, 1 or 2 digits.
+static const int numericTail[] = { 0, 4, 7 };
+
+int QREncoder::segmentBits(const std::vector<Segment> &segments,
+                           int version) {
+  int bits = 0;
+  for (const Segment &segment : segments) {
+    bits += modeLength(version) +
+        determineCCILength(version, segment.encoding);
+    switch (segment.encoding) {
+      case Encoding::Numeric:
+        bits += (segment.length / 3) * 10 + numericTail[segment.length % 3];
+        break;
+      case Encoding::Alpha:
+        bits += (segment.length / 2) * 11 + (segment.length % 2) * 6;
+        break;
+      case Encoding::Byte:
+        bits += segment.length * 8;
+        break;
+      case Encoding::Kanji:
+        bits += segment.length * 13;
+        break;
+      case Encoding::ECI:
+        bits += 8;  // assignment number
+        break;
+      case Encoding::StructuredAppend:
+        break;
+    }
+  }
+  return bits;
+}
+
+// the last version of each range of CCI lengths.
+static const int lastVersion[] = { 9, 26, 40 };
+
+static int cciRange(int version) {
+  return version < 10 ? 0 : version < 27 ? 1 : 2;
+}
+
+int QREncoder::determineVersion(std::string_view msg, ECL ecl,
+                                int headerBits,
+                                std::vector<Segment> *segments) {
+  const int bits[] = { headerBits, headerBits, headerBits };
+  return determineVersion(msg, ecl, bits, segments);
+}
+
+int QREncoder::determineVersion(std::string_view msg, ECL ecl,
+                                const int *headerBits,
+                                std::vector<Segment> *segments) {
+  // the best segmentation only changes where the CCI lengths do.
+  scratchClasses.resize(msg.length());
+  uint8_t all, any;
+  classify(msg, scratchClasses.data(), &all, &any);
+  int version = 1;
+  for (int i = 0; i < 3; i++) {
+    determineSegments(msg, scratchClasses.data(), all, any, lastVersion[i],
+                      segments);
+    int bits = segmentBits(*segments, lastVersion[i]) + headerBits[i];
+    for (; version <= lastVersion[i]; version++) {
+      if (bits <= determineCapacity(version, ecl) * 8) {
+        return version;
+      }
     }
   }
   return -1;
 }
 
-ECL QREncoder::determineOptimumECL(ECL ecl, int length, Encoding encoding,
-                                   int version) {
-  for (int i = 0; i < numModes; i++) {
-    if (modes[i].version == version && modes[i].ecl > ecl &&
-        ((encoding == Encoding::Numeric && length <= modes[i].numericMax) ||
-         (encoding == Encoding::Alpha && length <= modes[i].alphaMax) ||
-         (encoding == Encoding::Byte && length <= modes[i].byteMax))) {
-      ecl = modes[i].ecl;
+bool QREncoder::encodeMicro(std::string_view msg, ECL ecl, uint8_t *buffer,
+                            Message *message) {
+  scratchClasses.resize(msg.length());
+  uint8_t all, any;
+  classify(msg, scratchClasses.data(), &all, &any);
+
+  // the smallest version that fits, at the strongest ECL it has room for.
+  int best = -1;
+  int segmented = 0;
+  int bits = 0;
+  for (int i = 0; i < static_cast<int>(numMicros); i++) {
+    int version = -microTable[i].version;
+    if (best >= 0 && version != -microTable[best].version) {
+      break;
+    }
+    if (version != segmented) {
+      determineSegments(msg, scratchClasses.data(), all, any, version,
+                        &scratchSegments);
+      segmented = version;
+      bool encodable = msg.empty() || !scratchSegments.empty();
+      if (msg.empty()) {
+        // an empty segment would read as the terminator anyway.
+        scratchSegments.clear();
+      }
+      bits = encodable ? segmentBits(scratchSegments, version) : -1;
+      for (const Segment &segment : scratchSegments) {
+        if (segment.encoding == Encoding::ECI) {
+          bits = -1;  // Micro QR has no ECI
+        }
+      }
+    }
+    if (bits >= 0 && microTable[i].ecl >= ecl &&
+        bits <= microTable[i].dataBits) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    return false;
+  }
+
+  int version = -microTable[best].version;
+  int dataBits = microTable[best].dataBits;
+  int dataBytes = (dataBits + 7) / 8;
+  int numEC = microTable[best].ecCodewords;
+  BitStream stream;
+  stream.data = scratchCodewords;
+  stream.capacity = dataBytes;
+  writeSegments(msg, scratchSegments, version, &stream, nullptr);
+  // the terminator is 3, 5, 7 or 9 bits, cut short at capacity.
+  int terminator = std::min<int>(modeLength(version) * 2 + 3,
+                                 dataBits - stream.bitLength());
+  stream.write(0, terminator);
+  stream.padToByte();
+  // M1 and M3 end in a 4-bit codeword, which is never a pad codeword.
+  for (int i = 0; stream.bitLength() < (dataBits / 8) * 8u; i++) {
+    stream.write(i & 1 ? 0x11 : 0xec, 8);
+  }
+  if (stream.bitLength() < dataBytes * 8u) {
+    stream.write(0, 8);
+  }
+  stream.padToByte();  // flushes
+  if (stream.overflow) {
+    std::cerr << "Encoded message overflowed its symbol" << std::endl;
+    return false;
+  }
+
+  Block block;
+  block.data = scratchCodewords;
+  block.dataLen = dataBytes;
+  block.ec = scratchEC;
+  memset(scratchEC, 0, numEC);
+  ReedSolomon::encode(&block, 1, numEC);
+
+  // a single block, so nothing to interleave, but a 4-bit codeword means
+  // the EC codewords don't start on a byte.
+  BitStream out;
+  out.data = buffer;
+  out.capacity = maxMessageBytes;
+  out.writeBytes(scratchCodewords, dataBits / 8);
+  if (dataBits % 8) {
+    out.write(scratchCodewords[dataBits / 8] >> 4, 4);
+  }
+  out.writeBytes(scratchEC, numEC);
+  out.padToByte();
+  if (out.overflow) {
+    std::cerr << "Encoded message overflowed its symbol" << std::endl;
+    return false;
+  }
+
+  message->data = buffer;
+  message->length = dataBits + numEC * 8;
+  message->version = -version;
+  message->ecl = microTable[best].ecl;
+  message->micro = true;
+  return true;
+}
+
+// Moves pos forward to the start of a character, so a split never lands
+// inside a UTF-8 sequence or a Shift-JIS double byte character.
+static size_t characterStart(std::string_view msg, size_t from, size_t pos,
+                             bool utf8) {
+  if (utf8) {
+    while (pos < msg.length() && (msg[pos] & 0xc0) == 0x80) {
+      pos++;
+    }
+    return pos;
+  }
+  size_t i = from;
+  while (i < pos) {
+    uint8_t c = msg[i];
+    bool lead = (c >= 0x81 && c <= 0x9f) || (c >= 0xe0 && c <= 0xfc);
+    i += lead && i + 1 < msg.length() ? 2 : 1;
+  }
+  return i;
+}
+
+bool QREncoder::splitStructured(std::string_view msg, ECL ecl,
+                                std::vector<AppendPart> *parts) {
+  parts->clear();
+  if (determineVersion(msg, ecl, 0, &scratchSegments) > 0) {
+    parts->push_back({ msg, 0, 1, 0 });
+    return true;
+  }
+  uint8_t parity = 0;
+  for (char c : msg) {
+    parity ^= c;
+  }
+  uint8_t all, any;
+  classify(msg, scratchClasses.data(), &all, &any);
+  bool utf8 = (any & ClassHigh) && isUTF8(msg);
+
+  // parts can't pack much tighter than the whole message, so start near
+  // the fewest symbols it could fit in.
+  determineSegments(msg, scratchClasses.data(), all, any, 40,
+                    &scratchSegments);
+  int bits = segmentBits(scratchSegments, 40);
+  int capacity = determineCapacity(40, ecl) * 8 - appendHeaderBits;
+  int total = std::max(2, (bits + capacity - 1) / capacity - 1);
+  // equal byte counts, so every symbol takes about as long to make.
+  for (; total <= maxAppendSymbols; total++) {
+    parts->clear();
+    size_t start = 0;
+    bool fits = true;
+    for (int i = 0; i < total && fits; i++) {
+      size_t end = i == total - 1 ? msg.length() : characterStart(msg, start,
+          msg.length() * (i + 1) / total, utf8);
+      parts->push_back({ msg.substr(start, end - start), i, total, parity });
+      fits = determineVersion(parts->back().data, ecl, appendHeaderBits,
+                              &scratchSegments) > 0;
+      start = end;
+    }
+    if (fits) {
+      return true;
+    }
+  }
+  parts->clear();
+  return false;
+}
+
+ECL QREncoder::determineOptimumECL(ECL ecl, int bits, int version) {
+  for (int i = ecl + 1; i <= ECL::H; i++) {
+    if (bits <= determineCapacity(version, static_cast<ECL>(i)) * 8) {
+      ecl = static_cast<ECL>(i);
     }
   }
   return ecl;
 }
 
+int QREncoder::determineCapacity(int version, ECL ecl) {
+  int ecPerBlock, g1Blocks, g1DataPerBlock, g2Blocks, g2DataPerBlock;
+  determineBlockInfo(version, ecl, &ecPerBlock, &g1Blocks, &g1DataPerBlock,
+                     &g2Blocks, &g2DataPerBlock);
+  return g1Blocks * g1DataPerBlock + g2Blocks * g2DataPerBlock;
+}
+
 void QREncoder::determineBlockInfo(int version, ECL ecl, int *ecPerBlock,
                                    int *g1Blocks, int *g1DataPerBlock,
                                    int *g2Blocks, int *g2DataPerBlock) {
@@ -192,132 +704,440 @@ void QREncoder::determineBlockInfo(int version, ECL ecl, int *ecPerBlock,
   }
 }
 
+// Micro QR count lengths for numeric, alpha, byte and Kanji, with 0 where
+// the version doesn't have the mode.
+static const int microCCILengths[4][4] = {
+  { 3, 0, 0, 0 },  // M1
+  { 4, 3, 0, 0 },  // M2
+  { 5, 4, 4, 3 },  // M3
+  { 6, 5, 5, 4 },  // M4
+};
+
 int QREncoder::determineCCILength(int version, Encoding encoding) {
+  if (version < 0) {
+    const int *lengths = microCCILengths[-version - 1];
+    switch (encoding) {
+      case Encoding::Numeric:
+        return lengths[0];
+      case Encoding::Alpha:
+        return lengths[1];
+      case Encoding::Byte:
+        return lengths[2];
+      case Encoding::Kanji:
+        return lengths[3];
+      default:
+        return 0;
+    }
+  }
+  int size = cciRange(version);
   switch (encoding) {
     case Encoding::Numeric:
-      return 10;
+      return 10 + size * 2;
     case Encoding::Alpha:
-      return 9;
+      return 9 + size * 2;
     case Encoding::Byte:
-      return 8;
+      return size ? 16 : 8;
+    case Encoding::Kanji:
+      return 8 + size * 2;
+    case Encoding::StructuredAppend:
+    case Encoding::ECI:
+      return 0;
   }
   return 8;
 }
 
-void QREncoder::encodeNumeric(std::string msg, BitStream *stream) {
-  for (int i = 0; i < msg.length(); i += 3) {
-    int number = 0;
-    for (int j = 0; j < 3 && i + j < msg.length(); j++) {
-      number *= 10;
-      number += msg[i + j] - '0';
-    }
-    if (number < 100 && i + 3 >= msg.length()) {
-      if (number < 10) {
-        stream->write(number, 4);
-      } else {
-        stream->write(number, 7);
-      }
-    } else {
-      stream->write(number, 10);
-    }
+static inline uint32_t digitTriple(const char *p) {
+  return (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+}
+
+void QREncoder::encodeNumeric(std::string_view msg, BitStream *stream) {
+  const char *p = msg.data();
+  size_t i = 0;
+  // three groups make 30 bits, so they go in with a single write.
+  for (; i + 9 <= msg.length(); i += 9) {
+    stream->write((digitTriple(p + i) << 20) | (digitTriple(p + i + 3) << 10) |
+                  digitTriple(p + i + 6), 30);
+  }
+  for (; i + 3 <= msg.length(); i += 3) {
+    stream->write(digitTriple(p + i), 10);
+  }
+  // the group size sets the width, even when it has leading zeros.
+  if (msg.length() - i == 2) {
+    stream->write((p[i] - '0') * 10 + (p[i + 1] - '0'), 7);
+  } else if (msg.length() - i == 1) {
+    stream->write(p[i] - '0', 4);
   }
 }
 
-void QREncoder::encodeAlpha(std::string msg, BitStream *stream) {
-  static const char *special = " $%*+-./:";
+static inline uint32_t alphaPair(const char *p) {
+  return alphaValue(p[0]) * 45 + alphaValue(p[1]);
+}
 
-  for (int i = 0; i < msg.length(); i += 2) {
-    int code = 0;
-    for (int j = 0; j < 2 && i + j < msg.length(); j++) {
-      code *= 45;
-      if (msg[i + j] >= '0' && msg[i + j] <= '9') {
-        code += msg[i + j] - '0';
-      } else if (msg[i + j] >= 'A' && msg[i + j] <= 'Z') {
-        code += msg[i + j] - 'A' + 10;
-      } else {
-        code += strchr(special, msg[i + j]) - special + 36;
-      }
+void QREncoder::encodeAlpha(std::string_view msg, BitStream *stream) {
+  const char *p = msg.data();
+  size_t i = 0;
+  for (; i + 4 <= msg.length(); i += 4) {
+    stream->write((alphaPair(p + i) << 11) | alphaPair(p + i + 2), 22);
+  }
+  for (; i + 2 <= msg.length(); i += 2) {
+    stream->write(alphaPair(p + i), 11);
+  }
+  if (i < msg.length()) {
+    stream->write(alphaValue(p[i]), 6);
+  }
+}
+
+void QREncoder::encodeByte(std::string_view msg, BitStream *stream) {
+  stream->writeBytes(reinterpret_cast<const uint8_t *>(msg.data()),
+                     msg.length());
+}
+
+void QREncoder::encodeKanji(std::string_view msg, BitStream *stream) {
+  for (size_t i = 0; i + 1 < msg.length(); i += 2) {
+    uint16_t c = (static_cast<uint8_t>(msg[i]) << 8) |
+        static_cast<uint8_t>(msg[i + 1]);
+    c -= c <= 0x9ffc ? 0x8140 : 0xc140;
+    stream->write((c >> 8) * 0xc0 + (c & 0xff), 13);
+  }
+}
+
+// A run of data bits that holds some of a serial number's digits.
+struct CounterGroup {
+  uint32_t bitOffset;
+  int bits;
+  Encoding encoding;
+  int start;
+  int length;
+};
+
+static void formatCounter(uint64_t counter, int start, int width,
+                          std::string *msg) {
+  for (int i = width - 1; i >= 0; i--) {
+    (*msg)[start + i] = '0' + counter % 10;
+    counter /= 10;
+  }
+}
+
+static uint32_t groupValue(const std::string &msg, const CounterGroup &group) {
+  uint32_t value = 0;
+  for (int i = group.start; i < group.start + group.length; i++) {
+    switch (group.encoding) {
+      case Encoding::Numeric:
+        value = value * 10 + msg[i] - '0';
+        break;
+      case Encoding::Alpha:
+        value = value * 45 + alphaValue(msg[i]);
+        break;
+      default:
+        value = static_cast<uint8_t>(msg[i]);
+        break;
     }
-    if (i == msg.length() - 1) {
-      stream->write(code, 6);
+  }
+  return value;
+}
+
+static void setBits(uint8_t *bytes, uint32_t offset, uint32_t value,
+                    int bits) {
+  for (int i = bits - 1; i >= 0; i--, offset++) {
+    uint8_t bit = 0x80 >> (offset & 7);
+    if ((value >> i) & 1) {
+      bytes[offset >> 3] |= bit;
     } else {
-      stream->write(code, 11);
+      bytes[offset >> 3] &= ~bit;
     }
   }
 }
 
-void QREncoder::encodeByte(std::string msg, BitStream *stream) {
-  for (int i = 0; i < msg.length(); i++) {
-    stream->write(msg[i], 8);
+// rows[i * numEC] is the parity of a block that is all zero except for a
+// 1 at position i.  Parity is linear, so a byte that changes by delta
+// changes the parity by delta times its row.
+static void unitParity(int dataLen, int numEC, uint8_t *rows) {
+  const uint8_t one = 1, zero = 0;
+  uint8_t state[maxECPerBlock] = {};
+  for (int i = dataLen - 1; i >= 0; i--) {
+    ReedSolomon::update(i == dataLen - 1 ? &one : &zero, 1, numEC, state);
+    memcpy(rows + i * numEC, state, numEC);
   }
 }
 
-void QREncoder::reedSolomon(uint8_t *data, int numEC, int numData,
-                            uint8_t *ec) {
-  uint8_t *generator = createGenerator(numEC);
-  uint8_t terms[numEC + 1];
-  memset(terms, 0, numEC + 1);
+void QREncoder::encodeSerial(const std::string &pattern, uint64_t first,
+                             uint64_t last, ECL ecl,
+                             const SerialCallback &callback) {
+  size_t counterStart = pattern.find('#');
+  if (counterStart == std::string::npos) {
+    std::cerr << "Serial pattern needs a run of # for the counter"
+              << std::endl;
+    return;
+  }
+  size_t counterEnd = pattern.find_first_not_of('#', counterStart);
+  if (counterEnd == std::string::npos) {
+    counterEnd = pattern.length();
+  }
+  int width = counterEnd - counterStart;
+  uint64_t limit = 1;
+  for (int i = 0; i < width && i < 20; i++) {
+    limit *= 10;
+  }
+  if (first > last || (width < 20 && last >= limit)) {
+    std::cerr << "Counter range doesn't fit the pattern" << std::endl;
+    return;
+  }
+
+  // Every counter has the same character classes, so they all share one
+  // segmentation, version and layout.  Only the bits holding the digits
+  // change from one code to the next.
+  std::string msg = pattern;
+  formatCounter(first, counterStart, width, &msg);
+  std::vector<Segment> segments;
+  int version = determineVersion(msg, ecl, 0, &segments);
+  if (version < 0) {
+    std::cerr << "Message is too long to fit in a QR code" << std::endl;
+    return;
+  }
+  ecl = determineOptimumECL(ecl, segmentBits(segments, version), version);
+
+  int ecPerBlock = 0;
+  int g1Blocks = 0;
+  int g1DataPerBlock = 0;
+  int g2Blocks = 0;
+  int g2DataPerBlock = 0;
+  determineBlockInfo(version, ecl, &ecPerBlock, &g1Blocks, &g1DataPerBlock,
+                     &g2Blocks, &g2DataPerBlock);
+  int totalData = g1Blocks * g1DataPerBlock + g2Blocks * g2DataPerBlock;
+  int numBlocks = g1Blocks + g2Blocks;
 
-  for (int i = 0; i < numData; i++) {
-    uint8_t term = data[i] ^ terms[numEC - 1];
-    for (int j = numEC - 1; j > 0; j--) {
-      uint8_t val = 0;
-      if (generator[j] && term) {
-        val = gexp[glog[generator[j]] + glog[term]];
+  std::vector<uint8_t> codewords(totalData);
+  BitStream stream;
+  stream.data = codewords.data();
+  stream.capacity = totalData;
+  std::vector<uint32_t> dataOffsets;
+  writeSegments(msg, segments, version, &stream, &dataOffsets);
+  stream.padToCapacity();
+  if (stream.overflow) {
+    std::cerr << "Encoded message overflowed its symbol" << std::endl;
+    return;
+  }
+
+  std::vector<Block> blocks(numBlocks);
+  std::vector<uint8_t> ec(numBlocks * ecPerBlock);
+  for (int i = 0; i < numBlocks; i++) {
+    bool g1 = i < g1Blocks;
+    blocks[i].dataLen = g1 ? g1DataPerBlock : g2DataPerBlock;
+    blocks[i].data = codewords.data() + (g1 ? i * g1DataPerBlock :
+        g1Blocks * g1DataPerBlock + (i - g1Blocks) * g2DataPerBlock);
+    blocks[i].ec = ec.data() + i * ecPerBlock;
+  }
+  ReedSolomon::encode(blocks.data(), numBlocks, ecPerBlock);
+
+  std::vector<uint8_t> out(totalData + numBlocks * ecPerBlock + 1);
+  interleave(blocks.data(), numBlocks, ecPerBlock, out.data());
+  Message message;
+  message.data = out.data();
+  message.length = (out.size() - 1) * 8 + remainderBits[version - 1];
+  message.version = version;
+  message.ecl = ecl;
+  callback(first, message);
+  if (first == last) {
+    return;
+  }
+
+  // where each data codeword lives: its block, its offset in the block
+  // and its position in the interleaved message.
+  std::vector<int> blockOf(totalData), offsetOf(totalData);
+  std::vector<int> positionOf(totalData);
+  for (int i = 0, p = 0; i < numBlocks; i++) {
+    for (uint32_t j = 0; j < blocks[i].dataLen; j++, p++) {
+      blockOf[p] = i;
+      offsetOf[p] = j;
+      positionOf[p] = j < static_cast<uint32_t>(g1DataPerBlock) ?
+          j * numBlocks + i :
+          g1DataPerBlock * numBlocks + i - g1Blocks;
+    }
+  }
+  std::vector<uint8_t> g1Rows(g1DataPerBlock * ecPerBlock);
+  std::vector<uint8_t> g2Rows(g2DataPerBlock * ecPerBlock);
+  unitParity(g1DataPerBlock, ecPerBlock, g1Rows.data());
+  unitParity(g2DataPerBlock, ecPerBlock, g2Rows.data());
+
+  std::vector<CounterGroup> groups;
+  for (size_t i = 0; i < segments.size(); i++) {
+    const Segment &segment = segments[i];
+    int size = segment.encoding == Encoding::Numeric ? 3 :
+        segment.encoding == Encoding::Alpha ? 2 : 1;
+    int groupBits = segment.encoding == Encoding::Numeric ? 10 :
+        segment.encoding == Encoding::Alpha ? 11 : 8;
+    int end = segment.start + segment.length;
+    if (segment.encoding == Encoding::ECI ||
+        segment.encoding == Encoding::Kanji ||
+        end <= static_cast<int>(counterStart) ||
+        segment.start >= static_cast<int>(counterEnd)) {
+      continue;
+    }
+    int from = std::max<int>(segment.start, counterStart) - segment.start;
+    int to = std::min<int>(end, counterEnd) - segment.start;
+    for (int g = from / size; g * size < to; g++) {
+      CounterGroup group;
+      group.start = segment.start + g * size;
+      group.length = std::min(size, end - group.start);
+      group.bitOffset = dataOffsets[i] + g * groupBits;
+      group.bits = segment.encoding == Encoding::Numeric ?
+          group.length * 3 + 1 : segment.encoding == Encoding::Alpha ?
+          (group.length == 2 ? 11 : 6) : 8;
+      group.encoding = segment.encoding;
+      groups.push_back(group);
+    }
+  }
+
+  std::vector<bool> dirty(numBlocks);
+  for (uint64_t counter = first + 1; ; counter++) {
+    formatCounter(counter, counterStart, width, &msg);
+    for (const CounterGroup &group : groups) {
+      uint32_t firstByte = group.bitOffset / 8;
+      uint32_t lastByte = (group.bitOffset + group.bits - 1) / 8;
+      uint8_t before[4];
+      memcpy(before, codewords.data() + firstByte, lastByte - firstByte + 1);
+      setBits(codewords.data(), group.bitOffset, groupValue(msg, group),
+              group.bits);
+      for (uint32_t p = firstByte; p <= lastByte; p++) {
+        uint8_t delta = before[p - firstByte] ^ codewords[p];
+        if (delta == 0) {
+          continue;
+        }
+        int block = blockOf[p];
+        const uint8_t *row = (block < g1Blocks ? g1Rows : g2Rows).data() +
+            offsetOf[p] * ecPerBlock;
+        ReedSolomon::mulAdd(delta, row, ecPerBlock, blocks[block].ec);
+        out[positionOf[p]] = codewords[p];
+        dirty[block] = true;
+      }
+    }
+    for (int i = 0; i < numBlocks; i++) {
+      if (dirty[i]) {
+        for (int j = 0; j < ecPerBlock; j++) {
+          out[totalData + j * numBlocks + i] = blocks[i].ec[j];
+        }
+        dirty[i] = false;
       }
-      terms[j] = terms[j - 1] ^ val;
     }
-    terms[0] = 0;
-    if (generator[0] && term) {
-      terms[0] = gexp[glog[generator[0]] + glog[term]];
+    callback(counter, message);
+    if (counter == last) {
+      break;
     }
   }
-  delete [] generator;
-  int curEC = 0;
-  for (int i = numEC - 1; i >= 0; i--) {
-    ec[curEC++] = terms[i];
+}
+
+int QREncoder::addPrefix(std::string_view prefix) {
+  PrefixState state;
+  scratchClasses.resize(prefix.length());
+  uint8_t all, any;
+  classify(prefix, scratchClasses.data(), &all, &any);
+  for (int i = 0; i < 3; i++) {
+    determineSegments(prefix, scratchClasses.data(), all, any,
+                      lastVersion[i], &scratchSegments);
+    // room for the packed bits and the partial byte after them.
+    state.bytes[i].resize(segmentBits(scratchSegments, lastVersion[i]) / 8 +
+                          2);
+    BitStream stream;
+    stream.data = state.bytes[i].data();
+    stream.capacity = state.bytes[i].size();
+    writeSegments(prefix, scratchSegments, lastVersion[i], &stream, nullptr);
+    state.bits[i] = stream.bitLength();
+    stream.padToByte();
+    if (stream.overflow) {
+      std::cerr << "Encoded message overflowed its symbol" << std::endl;
+      return -1;
+    }
   }
+  prefixes.push_back(std::move(state));
+  return prefixes.size() - 1;
 }
 
-uint8_t *QREncoder::createGenerator(int numEC) {
-  uint8_t *poly = new uint8_t[numEC * 2];
-  memset(poly, 0, numEC * 2);
-  poly[0] = 1;
+Message QREncoder::encode(int prefix, std::string_view tail, ECL ecl,
+                          uint8_t *buffer) {
+  Message message;
+  if (prefix < 0 || prefix >= static_cast<int>(prefixes.size())) {
+    std::cerr << "Unknown prefix " << prefix << std::endl;
+    return message;
+  }
+  PrefixState &state = prefixes[prefix];
+  const int headerBits[] = {
+    static_cast<int>(state.bits[0]),
+    static_cast<int>(state.bits[1]),
+    static_cast<int>(state.bits[2]),
+  };
+  int version = determineVersion(tail, ecl, headerBits, &scratchSegments);
+  if (version < 0) {
+    std::cerr << "Message is too long to fit in a QR code" << std::endl;
+    return message;
+  }
+  int range = cciRange(version);
+  ecl = determineOptimumECL(ecl,
+      segmentBits(scratchSegments, version) + headerBits[range], version);
+
+  int ecPerBlock = 0;
+  int g1Blocks = 0;
+  int g1DataPerBlock = 0;
+  int g2Blocks = 0;
+  int g2DataPerBlock = 0;
+  determineBlockInfo(version, ecl, &ecPerBlock, &g1Blocks, &g1DataPerBlock,
+                     &g2Blocks, &g2DataPerBlock);
+  int totalData = g1Blocks * g1DataPerBlock + g2Blocks * g2DataPerBlock;
+  int numBlocks = g1Blocks + g2Blocks;
 
-  uint8_t *q = new uint8_t[numEC * 2];
-  memset(q, 0, numEC * 2);
-  uint8_t *temp = new uint8_t[numEC * 4];
-  memset(temp, 0, numEC * 4);
-  uint8_t *dest = new uint8_t[numEC * 2];
-  memset(dest, 0, numEC * 2);
+  // copy in the prefix's whole codewords and carry on from its last bits.
+  const uint8_t *bytes = state.bytes[range].data();
+  uint32_t wholeBytes = state.bits[range] / 8;
+  int partialBits = state.bits[range] % 8;
+  memcpy(scratchCodewords, bytes, wholeBytes);
+  BitStream stream;
+  stream.data = scratchCodewords + wholeBytes;
+  stream.capacity = totalData - wholeBytes;
+  if (partialBits) {
+    stream.write(bytes[wholeBytes] >> (8 - partialBits), partialBits);
+  }
+  writeSegments(tail, scratchSegments, version, &stream, nullptr);
+  stream.padToCapacity();
+  if (stream.overflow) {
+    std::cerr << "Encoded message overflowed its symbol" << std::endl;
+    return message;
+  }
 
-  for (int i = 0; i < numEC; i++) {
-    memset(q, 0, numEC * 2);
-    q[0] = gexp[i];
-    q[1] = 1;
+  uint8_t *data = scratchCodewords;
+  for (int i = 0; i < numBlocks; i++) {
+    scratchBlocks[i].dataLen = i < g1Blocks ? g1DataPerBlock : g2DataPerBlock;
+    scratchBlocks[i].data = data;
+    scratchBlocks[i].ec = scratchEC + i * ecPerBlock;
+    data += scratchBlocks[i].dataLen;
+  }
 
-    memset(dest, 0, numEC * 2);
-    for (int j = 0; j < numEC * 2; j++) {
-      memset(temp + numEC * 2, 0, numEC * 2);
-      for (int k = 0; k < numEC * 2; k++) {
-        if (poly[k] && q[j]) {
-          temp[k] = gexp[glog[poly[k]] + glog[q[j]]];
-        } else {
-          temp[k] = 0;
-        }
-      }
-      for (int k = numEC * 4 - 1; k >= j; k--) {
-        temp[k] = temp[k - j];
-      }
-      memset(temp, 0, j);
-      for (int k = 0; k < numEC * 2; k++) {
-        dest[k] ^= temp[k];
+  // the parity registers after the prefix only depend on the block layout.
+  std::vector<uint8_t> &parity = state.parity[version - 1][ecl];
+  if (parity.empty()) {
+    parity.resize(numBlocks * ecPerBlock);
+    for (int i = 0; i < numBlocks; i++) {
+      uint32_t start = scratchBlocks[i].data - scratchCodewords;
+      if (start < wholeBytes) {
+        ReedSolomon::update(scratchBlocks[i].data,
+            std::min(wholeBytes - start, scratchBlocks[i].dataLen),
+            ecPerBlock, parity.data() + i * ecPerBlock);
       }
     }
-    memcpy(poly, dest, numEC * 2);
   }
-  delete [] q;
-  delete [] temp;
-  delete [] dest;
-  return poly;
+  memcpy(scratchEC, parity.data(), numBlocks * ecPerBlock);
+  for (int i = 0; i < numBlocks; i++) {
+    uint32_t start = scratchBlocks[i].data - scratchCodewords;
+    uint32_t done = start < wholeBytes ?
+        std::min(wholeBytes - start, scratchBlocks[i].dataLen) : 0;
+    ReedSolomon::update(scratchBlocks[i].data + done,
+                        scratchBlocks[i].dataLen - done, ecPerBlock,
+                        scratchBlocks[i].ec);
+  }
+
+  interleave(scratchBlocks, numBlocks, ecPerBlock, buffer);
+  message.data = buffer;
+  message.length = (totalData + numBlocks * ecPerBlock) * 8 +
+      remainderBits[version - 1];
+  message.version = version;
+  message.ecl = ecl;
+  return message;
 }
@@ -3,6 +3,9 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
 #include <cstdint>
 #include "message.h"
 #include "bitstream.h"
@@ -18,6 +21,15 @@ enum Encoding {
   Numeric = 1,
   Alpha = 2,
   Byte = 4,
+  StructuredAppend = 3,
+  ECI = 7,
+  Kanji = 8,
+};
+
+struct Segment {
+  Encoding encoding;
+  int start;
+  int length;
 };
 
 struct Block {
@@ -26,25 +38,102 @@ struct Block {
   uint32_t dataLen;
 };
 
+// Bytes a message buffer needs to hold any version: the largest symbol has
+// 3706 codewords, plus a trailing pad byte.
+#define maxMessageBytes 3707
+// The most blocks any version splits its codewords into.
+#define maxBlocks 81
+
+// One symbol of a Structured Append sequence.  A total of 1 is a plain
+// symbol with no header.
+struct AppendPart {
+  std::string_view data;  // this symbol's slice of the message
+  int index;
+  int total;
+  uint8_t parity;  // xor of every byte of the whole message
+};
+
+typedef std::function<void(uint64_t counter, const Message &message)>
+    SerialCallback;
+
+// A message prefix shared by many codes, packed once for each range of
+// character count lengths (versions 1-9, 10-26 and 27-40).
+struct PrefixState {
+  std::vector<uint8_t> bytes[3];
+  uint32_t bits[3];
+  // parity registers of every block after the prefix's whole codewords,
+  // per version and ECL, filled in the first time a code needs them.
+  std::vector<uint8_t> parity[40][4];
+};
+
 class QREncoder {
  public:
-  QREncoder();
-  Message encode(std::string msg, ECL ecl);
+  // Use a Micro QR symbol (M1 to M4) when the message fits in one.
+  bool allowMicro = false;
+
+  Message encode(std::string_view msg, ECL ecl);
+  // Encodes into buffer, which must hold maxMessageBytes; the message
+  // points into it.  Scratch space is kept in the encoder, so once it has
+  // grown to fit the longest message, encoding doesn't allocate.
+  Message encode(std::string_view msg, ECL ecl, uint8_t *buffer);
+  Message encode(const AppendPart &part, ECL ecl, uint8_t *buffer);
+  // Splits msg into the fewest symbols that hold it, up to 16, giving each
+  // about the same number of bytes.  A message that fits in one symbol
+  // comes back as a single plain part.  Returns false if it is too long.
+  bool splitStructured(std::string_view msg, ECL ecl,
+                       std::vector<AppendPart> *parts);
+  // Encodes pattern once per counter from first to last, with its run of
+  // '#' replaced by the zero padded counter.  Only the changed codewords
+  // and their parity are recomputed between codes.  Each message is owned
+  // by the encoder and only valid until the callback returns.
+  void encodeSerial(const std::string &pattern, uint64_t first,
+                    uint64_t last, ECL ecl, const SerialCallback &callback);
+  // Packs prefix once and returns its id, for codes that are the prefix
+  // followed by a short tail, or -1 if it couldn't be packed.
+  int addPrefix(std::string_view prefix);
+  // Encodes the registered prefix followed by tail, resuming from the
+  // prefix's packed bits and parity so the work scales with the tail.  The
+  // two are segmented separately, so the code can be a few bits longer
+  // than encoding the whole message.
+  Message encode(int prefix, std::string_view tail, ECL ecl,
+                 uint8_t *buffer);
 
  private:
-  Encoding determineEncoding(std::string msg);
-  int determineVersion(int length, Encoding encoding, ECL ecl);
-  ECL determineOptimumECL(ECL ecl, int length, Encoding encoding, int version);
+  void determineSegments(std::string_view msg, const uint8_t *classes,
+                         uint8_t all, uint8_t any, int version,
+                         std::vector<Segment> *segments);
+  int segmentBits(const std::vector<Segment> &segments, int version);
+  bool encodeMicro(std::string_view msg, ECL ecl, uint8_t *buffer,
+                   Message *message);
+  int determineVersion(std::string_view msg, ECL ecl, int headerBits,
+                       std::vector<Segment> *segments);
+  // headerBits holds the bits ahead of msg for each range of CCI lengths.
+  int determineVersion(std::string_view msg, ECL ecl, const int *headerBits,
+                       std::vector<Segment> *segments);
+  ECL determineOptimumECL(ECL ecl, int bits, int version);
+  int determineCapacity(int version, ECL ecl);
   void determineBlockInfo(int version, ECL ecl, int *ecPerBlock,
                           int *g1Blocks, int *g1DataPerBlock,
                           int *g2Blocks, int *g2DataPerBlock);
   int determineCCILength(int version, Encoding encoding);
-  void encodeNumeric(std::string msg, BitStream *stream);
-  void encodeAlpha(std::string msg, BitStream *stream);
-  void encodeByte(std::string msg, BitStream *stream);
-  void reedSolomon(uint8_t *data, int numEC, int numData, uint8_t *ec);
-  uint8_t *createGenerator(int numEC);
-
-  uint8_t glog[256];
-  uint8_t gexp[512];
+  void writeSegments(std::string_view msg,
+                     const std::vector<Segment> &segments, int version,
+                     BitStream *stream, std::vector<uint32_t> *dataOffsets);
+  void interleave(const Block *blocks, int numBlocks, int ecPerBlock,
+                  uint8_t *out);
+  void encodeNumeric(std::string_view msg, BitStream *stream);
+  void encodeAlpha(std::string_view msg, BitStream *stream);
+  void encodeByte(std::string_view msg, BitStream *stream);
+  void encodeKanji(std::string_view msg, BitStream *stream);
+
+  // scratch space reused between encodes
+  std::vector<uint8_t> scratchClasses;
+  std::vector<int> scratchCost;
+  std::vector<uint8_t> scratchFrom;
+  std::vector<Segment> scratchSegments;
+  uint8_t scratchCodewords[maxMessageBytes];
+  uint8_t scratchEC[maxMessageBytes];
+  Block scratchBlocks[maxBlocks];
+
+  std::vector<PrefixState> prefixes;
 };
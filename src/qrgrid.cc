@@ -2,35 +2,67 @@
 
 #include "qrgrid.h"
 #include "colors.h"
+#include "workerpool.h"
+#include "bitlines.h"
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <climits>
+#include <atomic>
+#include <chrono>
+#include <memory>
 
 Bitmap QRGrid::generate(Message message) {
+  const GridTemplate &grid = getTemplate(message.version, message.micro);
+  Bitmap bmp = placeData(message, grid);
+  if (message.micro) {
+    int mask = findMicroMask(grid, &bmp);
+    addMicroFormat(getMicroFormatString(message.version, message.ecl, mask),
+                   &bmp);
+    return bmp;
+  }
+  int mask = findMask(grid, &bmp);
+  finishSymbol(message, mask, &bmp);
+  return bmp;
+}
+
+// Copies the template and scatters the message bits into it, unmasked.
+Bitmap QRGrid::placeData(const Message &message, const GridTemplate &grid) {
   Bitmap bmp;
-  bmp.size = ((message.version - 1) * 4) + 21;
+  bmp.micro = message.micro;
+  bmp.size = grid.size;
   bmp.data = new uint8_t[bmp.size * bmp.size];
-  memset(bmp.data, Color::Empty, bmp.size * bmp.size);
-
-  addPatterns(&bmp);
-  addAlignment(message.version, &bmp);
-  addTiming(&bmp);
-  reserveAreas(&bmp);
-  fillGrid(message.data, message.length, &bmp);
-  int mask = findMask(&bmp);
-  uint16_t format = getFormatString(message.ecl, mask);
-  addFormat(format, &bmp);
+  memcpy(bmp.data, grid.modules.data(), bmp.size * bmp.size);
 
+  uint32_t length = std::min<size_t>(message.length, grid.order.size());
+  const uint32_t *order = grid.order.data();
+  for (uint32_t i = 0; i < length; i++) {
+    bmp.data[order[i]] = (message.data[i >> 3] << (i & 7)) & 0x80 ?
+        Color::CodeOn : Color::CodeOff;
+  }
   return bmp;
 }
 
+// Adds the format and version information for a QR symbol once its mask
+// is applied.
+void QRGrid::finishSymbol(const Message &message, int mask, Bitmap *bmp) {
+  uint16_t format = getFormatString(message.ecl, mask);
+  addFormat(format, bmp);
+  if (message.version >= 7) {
+    addVersion(getVersionString(message.version), bmp);
+  }
+}
+
 void QRGrid::addPatterns(Bitmap *bmp) {
   int corners[] = {
     0, 0,
     bmp->size - 7, 0,
     0, bmp->size - 7,
   };
-  for (int i = 0; i < 3; i++) {
+  // Micro QR has just the top left finder.
+  for (int i = 0; i < (bmp->micro ? 1 : 3); i++) {
     int start = corners[i * 2] + corners[i * 2 + 1] * bmp->size;
     for (int y = 0; y < 7; y++) {
       int offset = y * bmp->size + start;
@@ -43,14 +75,19 @@ void QRGrid::addPatterns(Bitmap *bmp) {
   }
   // add separators
   for (int x = 0; x < bmp->size; x++) {
-    if (x < 8 || x > bmp->size - 8) {
+    if (bmp->micro && x < 8) {
+      bmp->data[7 * bmp->size + x] = Color::BG;
+      bmp->data[7 + x * bmp->size] = Color::BG;
+    } else if (bmp->micro) {
+      break;
+    } else if (x < 8 || x > bmp->size - 8) {
       if (x < 8) {
         bmp->data[(bmp->size - 8) * bmp->size + x] = Color::BG;
       }
       bmp->data[7 * bmp->size + x] = Color::BG;
     }
   }
-  for (int y = 0; y < bmp->size; y++) {
+  for (int y = 0; y < bmp->size && !bmp->micro; y++) {
     if (y < 8 || y > bmp->size - 8) {
       if (y < 8) {
         bmp->data[bmp->size - 8 + y * bmp->size] = Color::BG;
@@ -60,48 +97,109 @@ void QRGrid::addPatterns(Bitmap *bmp) {
   }
 }
 
-static const int alignxy[][2] = {
+// Alignment pattern centers; every pairing of these is used except the
+// three that overlap the finder patterns.
+static const int alignxy[][7] = {
   {},  // version 1
-  { 18, 18, },  // version 2
-  { 22, 22, },  // version 3
-  { 26, 26, },  // version 4
-  { 30, 30, },  // version 5
-  { 34, 34, },  // version 6
+  { 6, 18, },  // version 2
+  { 6, 22, },  // version 3
+  { 6, 26, },  // version 4
+  { 6, 30, },  // version 5
+  { 6, 34, },  // version 6
+  { 6, 22, 38, },  // version 7
+  { 6, 24, 42, },  // version 8
+  { 6, 26, 46, },  // version 9
+  { 6, 28, 50, },  // version 10
+  { 6, 30, 54, },  // version 11
+  { 6, 32, 58, },  // version 12
+  { 6, 34, 62, },  // version 13
+  { 6, 26, 46, 66, },  // version 14
+  { 6, 26, 48, 70, },  // version 15
+  { 6, 26, 50, 74, },  // version 16
+  { 6, 30, 54, 78, },  // version 17
+  { 6, 30, 56, 82, },  // version 18
+  { 6, 30, 58, 86, },  // version 19
+  { 6, 34, 62, 90, },  // version 20
+  { 6, 28, 50, 72, 94, },  // version 21
+  { 6, 26, 50, 74, 98, },  // version 22
+  { 6, 30, 54, 78, 102, },  // version 23
+  { 6, 28, 54, 80, 106, },  // version 24
+  { 6, 32, 58, 84, 110, },  // version 25
+  { 6, 30, 58, 86, 114, },  // version 26
+  { 6, 34, 62, 90, 118, },  // version 27
+  { 6, 26, 50, 74, 98, 122, },  // version 28
+  { 6, 30, 54, 78, 102, 126, },  // version 29
+  { 6, 26, 52, 78, 104, 130, },  // version 30
+  { 6, 30, 56, 82, 108, 134, },  // version 31
+  { 6, 34, 60, 86, 112, 138, },  // version 32
+  { 6, 30, 58, 86, 114, 142, },  // version 33
+  { 6, 34, 62, 90, 118, 146, },  // version 34
+  { 6, 30, 54, 78, 102, 126, 150, },  // version 35
+  { 6, 24, 50, 76, 102, 128, 154, },  // version 36
+  { 6, 28, 54, 80, 106, 132, 158, },  // version 37
+  { 6, 32, 58, 84, 110, 136, 162, },  // version 38
+  { 6, 26, 54, 82, 110, 138, 166, },  // version 39
+  { 6, 30, 58, 86, 114, 142, 170, },  // version 40
 };
 
 void QRGrid::addAlignment(int version, Bitmap *bmp) {
-  if (version == 1) {
-    return;
+  const int *centers = alignxy[version - 1];
+  int count = 0;
+  while (count < 7 && centers[count] != 0) {
+    count++;
   }
-  int start = alignxy[version - 1][0] + alignxy[version - 1][1] * bmp->size;
-  start -= 2 + 2 * bmp->size;
-  for (int y = 0; y < 5; y++) {
-    int offset = start + y * bmp->size;
-    for (int x = 0; x < 5; x++) {
-      bmp->data[offset++] = x == 0 || y == 0 || x == 4 || y == 4 ||
-          (x != 1 && y != 1 && x != 3 && y != 3) ? Color::Align : Color::BG;
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < count; j++) {
+      if ((i == 0 && j == 0) || (i == 0 && j == count - 1) ||
+          (i == count - 1 && j == 0)) {
+        continue;  // finder pattern
+      }
+      int start = centers[i] - 2 + (centers[j] - 2) * bmp->size;
+      for (int y = 0; y < 5; y++) {
+        int offset = start + y * bmp->size;
+        for (int x = 0; x < 5; x++) {
+          bmp->data[offset++] = x == 0 || y == 0 || x == 4 || y == 4 ||
+              (x != 1 && y != 1 && x != 3 && y != 3) ? Color::Align :
+              Color::BG;
+        }
+      }
     }
   }
 }
 
 void QRGrid::addTiming(Bitmap *bmp) {
+  // Micro QR timing runs along the top and left edges.
+  if (bmp->micro) {
+    for (int i = 8; i < bmp->size; i++) {
+      bmp->data[i] = (i & 1) ? Color::BG : Color::Timing;
+      bmp->data[i * bmp->size] = (i & 1) ? Color::BG : Color::Timing;
+    }
+    return;
+  }
   int offset = 6 * bmp->size;
   for (int x = 8; x < bmp->size - 8; x++) {
-    bmp->data[offset + x] = (x & 1) ? Color::BG : Color::Timing;
+    // alignment patterns on the timing line already match its phase.
+    if (bmp->data[offset + x] == Color::Empty) {
+      bmp->data[offset + x] = (x & 1) ? Color::BG : Color::Timing;
+    }
   }
   offset = 8 * bmp->size + 6;
   for (int y = 8; y < bmp->size - 8; y++) {
-    bmp->data[offset] = (y & 1) ? Color::BG : Color::Timing;
+    if (bmp->data[offset] == Color::Empty) {
+      bmp->data[offset] = (y & 1) ? Color::BG : Color::Timing;
+    }
     offset += bmp->size;
   }
 }
 
 void QRGrid::reserveAreas(Bitmap *bmp) {
   // dark module
-  bmp->data[(bmp->size - 8) * bmp->size + 8] = Color::Reserved;
+  if (!bmp->micro) {
+    bmp->data[(bmp->size - 8) * bmp->size + 8] = Color::Reserved;
+  }
   // format areas
   for (int x = 0; x < bmp->size; x++) {
-    if (x < 9 || x > bmp->size - 9) {
+    if (x < 9 || (!bmp->micro && x > bmp->size - 9)) {
       int offset = 8 * bmp->size + x;
       if (bmp->data[offset] == 0xff) {
         bmp->data[offset] = Color::Reserved;
@@ -112,275 +210,396 @@ void QRGrid::reserveAreas(Bitmap *bmp) {
       }
     }
   }
+  // version areas
+  if (bmp->size >= 45) {
+    for (int i = 0; i < 18; i++) {
+      int a = bmp->size - 11 + i % 3;
+      int b = i / 3;
+      bmp->data[b * bmp->size + a] = Color::Reserved;
+      bmp->data[a * bmp->size + b] = Color::Reserved;
+    }
+  }
 }
 
-void QRGrid::fillGrid(uint8_t *data, uint32_t length, Bitmap *bmp) {
-  int bitsLeft = 0;
-  uint8_t value = 0;
-  int column = 1;
-  int direction = -1;  // up
-  int x = bmp->size - 2;
-  int y = bmp->size - 1;
-  for (int bits = 0; bits < length; ) {
-    int offset = y * bmp->size + x + column;
-    if (bmp->data[offset] == 0xff) {
-      bits++;
-      if (bitsLeft == 0) {
-        bitsLeft = 8;
-        value = *data++;
+// Bit i is set if mask pattern i flips the module at x, y.
+static uint8_t maskFlips(int x, int y) {
+  int sum = x + y;
+  int product = x * y;
+  bool flips[] = {
+    (sum & 1) == 0,
+    (y & 1) == 0,
+    (x % 3) == 0,
+    (sum % 3) == 0,
+    ((y / 2 + x / 3) & 1) == 0,
+    (product & 1) + (product % 3) == 0,
+    (((product & 1) + (product % 3)) & 1) == 0,
+    (((sum & 1) + (product % 3)) & 1) == 0,
+  };
+  uint8_t bits = 0;
+  for (int i = 0; i < 8; i++) {
+    bits |= flips[i] << i;
+  }
+  return bits;
+}
+
+static inline void setBit(uint64_t *line, int i) {
+  line[i >> 6] |= 1ull << (i & 63);
+}
+
+// QR versions 1 to 40 then Micro QR M1 to M4, built the first time each
+// is used.
+static GridTemplate templates[44];
+static std::once_flag templatesBuilt[44];
+
+const GridTemplate &QRGrid::getTemplate(int version, bool micro) {
+  int index = micro ? 39 + version : version - 1;
+  std::call_once(templatesBuilt[index], [this, version, micro, index] {
+    buildTemplate(version, micro, &templates[index]);
+  });
+  return templates[index];
+}
+
+void QRGrid::buildTemplate(int version, bool micro, GridTemplate *grid) {
+  Bitmap bmp;
+  bmp.micro = micro;
+  bmp.size = micro ? version * 2 + 9 : ((version - 1) * 4) + 21;
+  grid->size = bmp.size;
+  grid->modules.assign(bmp.size * bmp.size, Color::Empty);
+  bmp.data = grid->modules.data();
+
+  addPatterns(&bmp);
+  if (!micro) {
+    addAlignment(version, &bmp);
+  }
+  addTiming(&bmp);
+  reserveAreas(&bmp);
+  placementOrder(bmp, &grid->order);
+
+  for (int i = 0; i < 8; i++) {
+    grid->masks[i] = BitGrid();
+    grid->masks[i].size = bmp.size;
+  }
+  for (uint32_t offset : grid->order) {
+    int x = offset % bmp.size;
+    int y = offset / bmp.size;
+    uint8_t flips = maskFlips(x, y);
+    for (int i = 0; i < 8; i++) {
+      if ((flips >> i) & 1) {
+        setBit(grid->masks[i].rows[y], x);
+        setBit(grid->masks[i].cols[x], y);
       }
-      bmp->data[offset] = (value & 0x80) ? Color::CodeOn : Color::CodeOff;
-      value <<= 1;
-      bitsLeft--;
     }
-    column ^= 1;
-    if (column == 1) {
-      y += direction;
-      if (direction < 0 && y < 0) {
-        y = 0;
-        direction = 1;
-        x -= 2;
-        if (x == 5) {  // skip vertical timing
-          x--;
-        }
-      } else if (direction > 0 && y >= bmp->size) {
-        y = bmp->size - 1;
-        direction = -1;
-        x -= 2;
-        if (x == 5) {  // skip vertical timing
-          x--;
+  }
+}
+
+// Walks the two-module wide columns in a zigzag from the bottom right,
+// collecting every module not taken by a function pattern.
+void QRGrid::placementOrder(const Bitmap &bmp,
+                            std::vector<uint32_t> *order) {
+  int direction = -1;  // up
+  for (int x = bmp.size - 2; x >= 0; x -= 2) {
+    if (x == 5 && !bmp.micro) {  // skip vertical timing
+      x--;
+    }
+    for (int i = 0; i < bmp.size; i++) {
+      int y = direction < 0 ? bmp.size - 1 - i : i;
+      for (int column = 1; column >= 0; column--) {
+        int offset = y * bmp.size + x + column;
+        if (bmp.data[offset] == Color::Empty) {
+          order->push_back(offset);
         }
       }
     }
+    direction = -direction;
   }
 }
 
-int QRGrid::findMask(Bitmap *bmp) {
-  int lowestPenalty = -1, lowestMask = 0;
+// Below this size, handing the candidates to the pool costs more than
+// scoring them.
+static const int parallelMinSize = 77;  // version 15
 
-  Bitmap masked;
-  masked.data = new uint8_t[bmp->size * bmp->size];
-  masked.size = bmp->size;
-  for (int i = 0; i < 8; i++) {
-    memcpy(masked.data, bmp->data, bmp->size * bmp->size);
-    applyMask(i, &masked);
-    int score = scoreGrid(&masked);
-    if (score < lowestPenalty || lowestPenalty < 0) {
-      lowestPenalty = score;
-      lowestMask = i;
+// Sets the dark modules of bmp in grid, which must start out clear.
+void QRGrid::packGrid(const Bitmap &bmp, BitGrid *grid) {
+  grid->size = bmp.size;
+  int offset = 0;
+  for (int y = 0; y < bmp.size; y++) {
+    for (int x = 0; x < bmp.size; x++) {
+      uint8_t color = bmp.data[offset++];
+      if (color != Color::BG && color != Color::CodeOff) {
+        setBit(grid->rows[y], x);
+        setBit(grid->cols[x], y);
+      }
     }
   }
-  delete [] masked.data;
-  applyMask(lowestMask, bmp);
-  return lowestMask;
 }
 
-void QRGrid::applyMask(int pattern, Bitmap *bmp) {
-  for (int y = 0; y < bmp->size; y++) {
-    for (int x = 0; x < bmp->size; x++) {
-      bool flip = false;
-      switch (pattern) {
-        case 0:
-          flip = ((x + y) & 1) == 0;
-          break;
-        case 1:
-          flip = (y & 1) == 0;
-          break;
-        case 2:
-          flip = (x % 3) == 0;
-          break;
-        case 3:
-          flip = ((x + y) % 3) == 0;
-          break;
-        case 4:
-          flip = ((y / 2 + x / 3) & 1) == 0;
-          break;
-        case 5:
-          flip = ((x * y) & 1) + ((x * y) % 3) == 0;
-          break;
-        case 6:
-          flip = ((((x * y) & 1) + ((x * y) % 3)) & 1) == 0;
-          break;
-        case 7:
-          flip = ((((x + y) & 1) + ((x * y) % 3)) & 1) == 0;
-          break;
+// Marks a candidate the budget ran out before.
+static const int notScored = -2;
+
+int QRGrid::findMask(const GridTemplate &grid, Bitmap *bmp) {
+  int lowestPenalty = -1, lowestMask = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto overBudget = [this, start] {
+    return maskBudget && std::chrono::steady_clock::now() - start >=
+        std::chrono::microseconds(maskBudget);
+  };
+  lastMask = MaskChoice();
+  lastMask.mode = maskMode;
+
+  // grid 0 is the unmasked symbol.  In parallel each candidate gets its
+  // own grid to mask, otherwise they share grid 1.  Each thread keeps its
+  // grids, so only the lines of this symbol are cleared.
+  bool parallel = maskMode == MaskMode::Optimal && parallelMasks &&
+      bmp->size >= parallelMinSize;
+  thread_local std::unique_ptr<BitGrid[]> grids(new BitGrid[9]);
+  BitGrid &base = grids[0];
+  memset(base.rows, 0, sizeof(base.rows[0]) * bmp->size);
+  memset(base.cols, 0, sizeof(base.cols[0]) * bmp->size);
+  packGrid(*bmp, &base);
+
+  // the first candidate is always scored, whatever the budget.
+  int scores[8];
+  std::fill(scores, scores + 8, notScored);
+  if (maskMode == MaskMode::Fixed) {
+    lowestMask = fixedMask & 7;
+  } else if (maskMode == MaskMode::Fast) {
+    for (int i = 0; i < 8 && !(i && overBudget()); i++) {
+      maskGrid(base, grid.masks[i], &grids[1]);
+      scores[i] = scoreFast(grids[1]);
+    }
+  } else if (parallel) {
+    // only prune candidates strictly worse than the best so far, so ties
+    // are scored in full and still go to the lowest mask.
+    std::atomic<int> best(INT_MAX);
+    WorkerPool::shared(8).run(8, [&](int i) {
+      if (i && overBudget()) {
+        return;
       }
-      if (flip) {
-        int offset = y * bmp->size + x;
-        if (bmp->data[offset] == CodeOn) {
-          bmp->data[offset] = CodeOff;
-        } else if (bmp->data[offset] == CodeOff) {
-          bmp->data[offset] = CodeOn;
-        }
+      int bound = best.load();
+      scores[i] = scoreMask(base, grid.masks[i],
+                            bound == INT_MAX ? -1 : bound + 1, &grids[i + 1]);
+      while (scores[i] >= 0 && scores[i] < bound &&
+             !best.compare_exchange_weak(bound, scores[i])) {
+      }
+    });
+  } else {
+    int bound = -1;
+    for (int i = 0; i < 8 && !(i && overBudget()); i++) {
+      scores[i] = scoreMask(base, grid.masks[i], bound, &grids[1]);
+      if (scores[i] >= 0 && (scores[i] < bound || bound < 0)) {
+        bound = scores[i];
       }
     }
   }
+  for (int i = 0; i < 8 && maskMode != MaskMode::Fixed; i++) {
+    if (scores[i] == notScored) {
+      lastMask.overBudget = true;
+      continue;
+    }
+    maskStats.candidates++;
+    if (scores[i] < 0) {
+      maskStats.pruned++;
+      continue;
+    }
+    if (scores[i] < lowestPenalty || lowestPenalty < 0) {
+      lowestPenalty = scores[i];
+      lowestMask = i;
+    }
+  }
+  // report the full penalty, which only the optimal search already has.
+  lastMask.mask = lowestMask;
+  lastMask.penalty = maskMode == MaskMode::Optimal ? lowestPenalty :
+      scoreMask(base, grid.masks[lowestMask], -1, &grids[1]);
+  applyMask(grid.masks[lowestMask], bmp);
+  return lowestMask;
 }
 
-int QRGrid::scoreGrid(Bitmap *bmp) {
-  // flatten grid for score
-  for (int i = 0; i < bmp->size * bmp->size; i++) {
-    if (bmp->data[i] == Color::BG || bmp->data[i] == Color::CodeOff) {
-      bmp->data[i] = 0;
-    } else {
-      bmp->data[i] = 1;
+void QRGrid::maskGrid(const BitGrid &base, const BitGrid &mask,
+                      BitGrid *masked) {
+  masked->size = base.size;
+  for (int j = 0; j < base.size; j++) {
+    for (int w = 0; w < gridWords; w++) {
+      masked->rows[j][w] = base.rows[j][w] ^ mask.rows[j][w];
+      masked->cols[j][w] = base.cols[j][w] ^ mask.cols[j][w];
     }
   }
+}
 
-  return scoreRule1(bmp) + scoreRule2(bmp) + scoreRule3(bmp) + scoreRule4(bmp);
+// Scores base with mask applied, which is built in masked.
+int QRGrid::scoreMask(const BitGrid &base, const BitGrid &mask, int bound,
+                      BitGrid *masked) {
+  maskGrid(base, mask, masked);
+  return scoreGrid(*masked, bound);
 }
 
-int QRGrid::scoreRule1(Bitmap *bmp) {
-  int penalty = 0;
+void QRGrid::applyMask(const BitGrid &mask, Bitmap *bmp) {
+  // the mask only covers data modules, and CodeOn ^ CodeOff swaps them.
+  const uint8_t swap = Color::CodeOn ^ Color::CodeOff;
   for (int y = 0; y < bmp->size; y++) {
-    int run = 1;
-    uint8_t prev = 0xff;
-    int offset = y * bmp->size;
-    for (int x = 0; x < bmp->size; x++) {
-      if (bmp->data[offset] == prev) {
-        run++;
-      } else {
-        if (run >= 5) {
-          penalty += run - 2;
-        }
-        run = 1;
-        prev = bmp->data[offset];
+    uint8_t *row = bmp->data + y * bmp->size;
+    for (int w = 0; w < gridWords; w++) {
+      for (uint64_t bits = mask.rows[y][w]; bits; bits &= bits - 1) {
+        row[w * 64 + __builtin_ctzll(bits)] ^= swap;
       }
-      offset++;
-    }
-    if (run >= 5) {
-      penalty += run - 2;
     }
   }
-  for (int x = 0; x < bmp->size; x++) {
-    int run = 1;
-    uint8_t prev = 0xff;
-    int offset = x;
-    for (int y = 0; y < bmp->size; y++) {
-      if (bmp->data[offset] == prev) {
-        run++;
-      } else {
-        if (run >= 5) {
-          penalty += run - 2;
-        }
-        run = 1;
-        prev = bmp->data[offset];
-      }
-      offset += bmp->size;
-    }
-    if (run >= 5) {
-      penalty += run - 2;
+}
+
+// Micro QR masks are QR masks 1, 4, 6 and 7.
+static const int microMasks[] = { 1, 4, 6, 7 };
+
+int QRGrid::findMicroMask(const GridTemplate &grid, Bitmap *bmp) {
+  int highestScore = -1, highestMask = 0;
+
+  Bitmap masked;
+  masked.data = new uint8_t[bmp->size * bmp->size];
+  masked.size = bmp->size;
+  masked.micro = true;
+  for (int i = 0; i < 4; i++) {
+    memcpy(masked.data, bmp->data, bmp->size * bmp->size);
+    applyMask(grid.masks[microMasks[i]], &masked);
+    int score = scoreMicro(&masked);
+    if (score > highestScore) {
+      highestScore = score;
+      highestMask = i;
     }
   }
-  return penalty;
+  delete [] masked.data;
+  applyMask(grid.masks[microMasks[highestMask]], bmp);
+  return highestMask;
+}
+
+// Micro QR wants dark modules along the right and bottom edges, which the
+// timing patterns don't cover.  Higher is better.
+int QRGrid::scoreMicro(Bitmap *bmp) {
+  int right = 0, bottom = 0;
+  for (int i = 1; i < bmp->size; i++) {
+    right += bmp->data[i * bmp->size + bmp->size - 1] == Color::CodeOn;
+    bottom += bmp->data[(bmp->size - 1) * bmp->size + i] == Color::CodeOn;
+  }
+  return right <= bottom ? right * 16 + bottom : bottom * 16 + right;
 }
 
-int QRGrid::scoreRule2(Bitmap *bmp) {
+// Adds up the rules cheapest first, and returns -1 once the penalty
+// reaches bound, since the candidate can no longer beat it.  The line by
+// line rules stop partway through as soon as they pass what is left of
+// the bound.  A negative bound scores everything.
+int QRGrid::scoreGrid(const BitGrid &grid, int bound) {
+  if (bound < 0) {
+    bound = INT_MAX;
+  }
+  int penalty = scoreRule4(grid);
+  if (penalty >= bound) {
+    return -1;
+  }
+  penalty += scoreRule2(grid);
+  if (penalty >= bound) {
+    return -1;
+  }
+  penalty += scoreRule1(grid, bound - penalty);
+  if (penalty >= bound) {
+    return -1;
+  }
+  penalty += scoreRule3(grid, bound - penalty);
+  return penalty >= bound ? -1 : penalty;
+}
+
+int QRGrid::scoreRule1(const BitGrid &grid, int limit) {
+  uint64_t runs = 0;
   int penalty = 0;
-  for (int y = 0; y < bmp->size - 1; y++) {
-    int offset = y * bmp->size;
-    for (int x = 0; x < bmp->size - 1; x++) {
-      if (bmp->data[offset] == bmp->data[offset + 1] &&
-          bmp->data[offset] == bmp->data[offset + bmp->size] &&
-          bmp->data[offset] == bmp->data[offset + 1 + bmp->size]) {
-        penalty += 3;
-      }
-      offset++;
-    }
+  for (int i = 0; i < grid.size && penalty < limit; i++) {
+    runPenalty(grid.rows[i], grid.size, &runs);
+    runPenalty(grid.cols[i], grid.size, &runs);
+    penalty = runs;
   }
   return penalty;
 }
 
-int QRGrid::scoreRule3(Bitmap *bmp) {
-  uint8_t bad[] = { 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0 };
-  uint8_t bad2[] = { 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1 };
-  int penalty = scoreRule3a(bmp, bad);
-  penalty += scoreRule3a(bmp, bad2);
-  return penalty;
+int QRGrid::scoreRule2(const BitGrid &grid) {
+  uint64_t blocks = 0;
+  uint64_t valid[gridWords];
+  lowBits(grid.size - 1, valid);
+  for (int y = 0; y < grid.size - 1; y++) {
+    blockCount(grid.rows[y], grid.rows[y + 1], valid, &blocks);
+  }
+  return blocks * 3;
 }
 
-int QRGrid::scoreRule3a(Bitmap *bmp, uint8_t *pat) {
+int QRGrid::scoreRule3(const BitGrid &grid, int limit) {
+  uint64_t matches = 0;
   int penalty = 0;
-  for (int y = 0; y < bmp->size; y++) {
-    int offset = y * bmp->size;
-    int match = 0;
-    for (int x = 0; x < bmp->size; x++) {
-      if (bmp->data[offset] == pat[match]) {
-        match++;
-      } else {
-        offset -= match;
-        x -= match;
-        match = 0;
-      }
-      if (match == 11) {
-        penalty += 40;
-        match = 0;
-      }
-      offset++;
-    }
-    if (match == 11) {
-      penalty += 40;
-    }
-  }
-  for (int x = 0; x < bmp->size; x++) {
-    int offset = x;
-    int match = 0;
-    for (int y = 0; y < bmp->size; y++) {
-      if (bmp->data[offset] == pat[match]) {
-        match++;
-      } else {
-        offset -= match * bmp->size;
-        y -= match;
-        match = 0;
-      }
-      if (match == 11) {
-        penalty += 40;
-        match = 0;
-      }
-      offset += bmp->size;
-    }
-    if (match == 11) {
-      penalty += 40;
-    }
+  for (int i = 0; i < grid.size && penalty < limit; i++) {
+    finderCount(grid.rows[i], grid.size, &matches);
+    finderCount(grid.cols[i], grid.size, &matches);
+    penalty = matches * 40;
   }
   return penalty;
 }
 
-int QRGrid::scoreRule4(Bitmap *bmp) {
-  int dark = 0;
-  for (int y = 0; y < bmp->size; y++) {
-    int offset = y * bmp->size;
-    for (int x = 0; x < bmp->size; x++) {
-      if (bmp->data[offset++] == 1) {
-        dark++;
-      }
-    }
+// A cheap stand in for the full penalty: rules 2 and 4, and runs along
+// the rows only.  No finder-like patterns or column runs are counted.
+int QRGrid::scoreFast(const BitGrid &grid) {
+  uint64_t runs = 0;
+  for (int y = 0; y < grid.size; y++) {
+    runPenalty(grid.rows[y], grid.size, &runs);
   }
-  dark = (dark * 100) / (bmp->size * bmp->size);
-  int prevFive = dark / 5;
-  prevFive *= 5;
-  int nextFive = prevFive + 5;
-  prevFive = abs(prevFive - 50) / 5;
-  nextFive = abs(nextFive - 50) / 5;
-  if (prevFive < nextFive) {
-    return prevFive * 10;
+  return scoreRule4(grid) + scoreRule2(grid) + runs;
+}
+
+int QRGrid::scoreRule4(const BitGrid &grid) {
+  uint64_t dark = 0;
+  for (int y = 0; y < grid.size; y++) {
+    countLine(grid.rows[y], &dark);
   }
-  return nextFive * 10;
+  return darkPenalty(dark, grid.size);
 }
 
 static uint16_t formatStrings[] = {
-  0x5412, 0x5125, 0x5e7c, 0x5b4b, 0x4579, 0x40ce, 0x4797, 0x4aa0,  // m
+  0x5412, 0x5125, 0x5e7c, 0x5b4b, 0x45f9, 0x40ce, 0x4f97, 0x4aa0,  // m
   0x77c4, 0x72f3, 0x7daa, 0x789d, 0x662f, 0x6318, 0x6c41, 0x6976,  // l
   0x1689, 0x13be, 0x1ce7, 0x19d0, 0x0762, 0x0255, 0x0d0c, 0x083b,  // h
   0x355f, 0x3068, 0x3f31, 0x3a06, 0x24b4, 0x2183, 0x2eda, 0x2bed,  // q
 };
 
+// 18-bit version information, for versions 7 through 40.
+static uint32_t versionStrings[] = {
+  0x07c94, 0x085bc, 0x09a99, 0x0a4d3, 0x0bbf6, 0x0c762,
+  0x0d847, 0x0e60d, 0x0f928, 0x10b78, 0x1145d, 0x12a17,
+  0x13532, 0x149a6, 0x15683, 0x168c9, 0x177ec, 0x18ec4,
+  0x191e1, 0x1afab, 0x1b08e, 0x1cc1a, 0x1d33f, 0x1ed75,
+  0x1f250, 0x209d5, 0x216f0, 0x228ba, 0x2379f, 0x24b0b,
+  0x2542e, 0x26a64, 0x27541, 0x28c69,
+};
+
 static uint8_t eclFormat[] = { 1, 0, 3, 2 };
 
+// 15-bit Micro QR format information, by symbol number then mask.
+static uint16_t microFormatStrings[] = {
+  0x4445, 0x4172, 0x4e2b, 0x4b1c,  // M1
+  0x55ae, 0x5099, 0x5fc0, 0x5af7,  // M2-L
+  0x6793, 0x62a4, 0x6dfd, 0x68ca,  // M2-M
+  0x7678, 0x734f, 0x7c16, 0x7921,  // M3-L
+  0x06de, 0x03e9, 0x0cb0, 0x0987,  // M3-M
+  0x1735, 0x1202, 0x1d5b, 0x186c,  // M4-L
+  0x2508, 0x203f, 0x2f66, 0x2a51,  // M4-M
+  0x34e3, 0x31d4, 0x3e8d, 0x3bba,  // M4-Q
+};
+
+// first symbol number of each Micro QR version; the ECL is added on.
+static uint8_t microSymbols[] = { 0, 1, 3, 5 };
+
 uint16_t QRGrid::getFormatString(int ecl, int mask) {
   return formatStrings[(eclFormat[ecl] << 3) | mask];
 }
 
+uint16_t QRGrid::getMicroFormatString(int version, int ecl, int mask) {
+  return microFormatStrings[((microSymbols[version - 1] + ecl) << 2) | mask];
+}
+
+uint32_t QRGrid::getVersionString(int version) {
+  return versionStrings[version - 7];
+}
+
 void QRGrid::addFormat(uint16_t format, Bitmap *bmp) {
   format <<= 1;  // start with first bit in pos 15
   int xoffset = bmp->size * 8;
@@ -405,3 +624,24 @@ void QRGrid::addFormat(uint16_t format, Bitmap *bmp) {
   }
   bmp->data[(bmp->size - 8) * bmp->size + 8] = Color::CodeOn;  // on-block
 }
+
+void QRGrid::addVersion(uint32_t version, Bitmap *bmp) {
+  for (int i = 0; i < 18; i++) {
+    uint8_t color = (version & 1) ? Color::CodeOn : Color::CodeOff;
+    version >>= 1;
+    int a = bmp->size - 11 + i % 3;
+    int b = i / 3;
+    bmp->data[b * bmp->size + a] = color;  // top right
+    bmp->data[a * bmp->size + b] = color;  // bottom left
+  }
+}
+
+void QRGrid::addMicroFormat(uint16_t format, Bitmap *bmp) {
+  // bits 0-7 go down column 8, bits 14-7 go along row 8.
+  for (int i = 0; i < 8; i++) {
+    bmp->data[(i + 1) * bmp->size + 8] =
+        ((format >> i) & 1) ? Color::CodeOn : Color::CodeOff;
+    bmp->data[8 * bmp->size + i + 1] =
+        ((format >> (14 - i)) & 1) ? Color::CodeOn : Color::CodeOff;
+  }
+}
@@ -2,31 +2,110 @@
 
 #pragma once
 
+#include <vector>
 #include "message.h"
 
+// Enough 64-bit words for a row of the largest symbol, 177 modules.
+#define gridWords 3
+#define maxGridSize 177
+
+// One bit per module, set for dark, with bit x of a line in word x / 64.
+// The grid is kept both by rows and by columns, so every scoring rule is a
+// scan along words in either direction.
+struct BitGrid {
+  int size = 0;
+  uint64_t rows[maxGridSize][gridWords];
+  uint64_t cols[maxGridSize][gridWords];
+};
+
 struct Bitmap {
   uint8_t *data = nullptr;
   int size = 0;
+  bool micro = false;
+};
+
+// Everything about a symbol that depends only on its version: the function
+// patterns, with Empty where data goes, the offsets of the data modules in
+// the order the message bits are placed, and the data modules each mask
+// pattern flips.
+struct GridTemplate {
+  int size = 0;
+  std::vector<uint8_t> modules;
+  std::vector<uint32_t> order;
+  BitGrid masks[8];
+};
+
+// How much of the mask search was skipped.  A candidate is pruned once
+// the rules scored so far already reach the best complete penalty.
+struct MaskStats {
+  uint64_t candidates = 0;
+  uint64_t pruned = 0;
+};
+
+enum class MaskMode {
+  Optimal,  // the lowest penalty, as the spec asks
+  Fast,  // the lowest penalty by a few cheap rules
+  Fixed,  // always fixedMask
+};
+
+// How the mask of the last QR symbol was picked.
+struct MaskChoice {
+  MaskMode mode = MaskMode::Optimal;
+  int mask = 0;
+  int penalty = 0;  // full penalty of the chosen mask
+  bool overBudget = false;  // the budget ran out before every mask was tried
 };
 
 class QRGrid {
  public:
   Bitmap generate(Message message);
+  // Generates many symbols, scoring the masks of same-version QR symbols
+  // several at a time with one symbol per vector lane.  Each gets the same
+  // mask generate would pick.  Micro QR symbols, and any mask mode or
+  // budget besides the full search, go through generate one at a time.
+  std::vector<Bitmap> generateBatch(const std::vector<Message> &messages);
+
+  // Score the mask candidates of large symbols on a shared pool of
+  // threads.  The chosen mask is the same either way.
+  bool parallelMasks = false;
+  // How QR masks are picked.  Micro QR symbols always try all four.
+  MaskMode maskMode = MaskMode::Optimal;
+  int fixedMask = 0;
+  // Keep the best mask found within this many microseconds, or 0 to try
+  // them all.
+  uint32_t maskBudget = 0;
+  MaskChoice lastMask;
+  // totals over every symbol this grid has generated
+  MaskStats maskStats;
 
  private:
   void addPatterns(Bitmap *bitmap);
   void addAlignment(int version, Bitmap *bitmap);
   void addTiming(Bitmap *bitmap);
   void reserveAreas(Bitmap *bitmap);
-  void fillGrid(uint8_t *data, uint32_t len, Bitmap *bitmap);
-  int findMask(Bitmap *bitmap);
-  void applyMask(int pattern, Bitmap *bitmap);
-  int scoreGrid(Bitmap *bitmap);
-  int scoreRule1(Bitmap *bitmap);
-  int scoreRule2(Bitmap *bitmap);
-  int scoreRule3(Bitmap *bitmap);
-  int scoreRule3a(Bitmap *bitmap, uint8_t *pattern);
-  int scoreRule4(Bitmap *bitmap);
+  const GridTemplate &getTemplate(int version, bool micro);
+  Bitmap placeData(const Message &message, const GridTemplate &grid);
+  void finishSymbol(const Message &message, int mask, Bitmap *bitmap);
+  void buildTemplate(int version, bool micro, GridTemplate *grid);
+  void placementOrder(const Bitmap &bitmap, std::vector<uint32_t> *order);
+  void packGrid(const Bitmap &bitmap, BitGrid *grid);
+  int findMask(const GridTemplate &grid, Bitmap *bitmap);
+  int findMicroMask(const GridTemplate &grid, Bitmap *bitmap);
+  void maskGrid(const BitGrid &base, const BitGrid &mask, BitGrid *masked);
+  int scoreMask(const BitGrid &base, const BitGrid &mask, int bound,
+                BitGrid *masked);
+  void applyMask(const BitGrid &mask, Bitmap *bitmap);
+  int scoreGrid(const BitGrid &grid, int bound);
+  int scoreFast(const BitGrid &grid);
+  int scoreRule1(const BitGrid &grid, int limit);
+  int scoreRule2(const BitGrid &grid);
+  int scoreRule3(const BitGrid &grid, int limit);
+  int scoreRule4(const BitGrid &grid);
+  int scoreMicro(Bitmap *bitmap);
   uint16_t getFormatString(int ecl, int mask);
   void addFormat(uint16_t format, Bitmap *bitmap);
+  uint16_t getMicroFormatString(int version, int ecl, int mask);
+  void addMicroFormat(uint16_t format, Bitmap *bitmap);
+  uint32_t getVersionString(int version);
+  void addVersion(uint32_t version, Bitmap *bitmap);
 };
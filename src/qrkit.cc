@@ -4,6 +4,9 @@
 #include <iostream>
 #include <cstdint>
 #include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
 #include "qrencoder.h"
 #include "qrgrid.h"
 #include "colors.h"
@@ -21,6 +24,7 @@ static struct argp_option options[] = {
   {"out", 'o', "FILENAME", 0, "Output filename (default qr.png)"},
   {"ppi_x", 1000, "INTEGER", 0, "Horizontal pixels per inch (ignored by default)"},
   {"ppi_y", 1001, "INTEGER", 0, "Vertical pixels per inch (ignored by default)"},
+  {"compose", 1002, 0, 0, "Put Structured Append symbols in one image instead of one file each"},
   { 0 }
 };
 
@@ -30,6 +34,7 @@ struct arguments {
   const char *embed;
   std::string message;
   bool gray;
+  bool compose;
   unsigned int ppi_x, ppi_y;
 };
 
@@ -54,6 +59,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     case 1001:
       arguments->ppi_y = atoi(arg);
       break;
+    case 1002:
+      arguments->compose = true;
+      break;
     case ARGP_KEY_ARG:
       if (!arguments->message.empty()) {
         arguments->message += " ";
@@ -73,12 +81,48 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = { options, parse_opt, args_doc, doc };
 
+// qr.png becomes qr-1.png, qr-2.png, ...
+static std::string partFilename(const char *outfile, int number) {
+  std::string name = outfile;
+  size_t dot = name.rfind('.');
+  size_t slash = name.rfind('/');
+  if (dot == std::string::npos ||
+      (slash != std::string::npos && dot < slash)) {
+    dot = name.length();
+  }
+  return name.substr(0, dot) + "-" + std::to_string(number) +
+      name.substr(dot);
+}
+
+static void configureGrid(const Config &config, QRGrid *grid) {
+  grid->parallelMasks = config.parallelMasks;
+  grid->maskMode = config.maskMode;
+  grid->fixedMask = config.fixedMask;
+  grid->maskBudget = config.maskBudget;
+}
+
+// Says how the mask was picked, when the config traded the full search
+// for speed.
+static void reportMask(const Config &config, bool micro,
+                       const MaskChoice &choice, const std::string &label) {
+  if (micro || (config.maskMode == MaskMode::Optimal &&
+                config.maskBudget == 0)) {
+    return;
+  }
+  static const char *modes[] = { "optimal", "fast", "fixed" };
+  std::cout << label << "mask " << choice.mask << " ("
+            << modes[static_cast<int>(choice.mode)]
+            << (choice.overBudget ? ", over budget" : "") << "), penalty "
+            << choice.penalty << std::endl;
+}
+
 int main(int argc, char **argv) {
   struct arguments arguments;
   arguments.outfile = "qr.png";
   arguments.config = "config.json";
   arguments.embed = nullptr;
   arguments.gray = false;
+  arguments.compose = false;
   arguments.ppi_x = 0;
   arguments.ppi_y = 0;
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
@@ -112,10 +156,61 @@ int main(int argc, char **argv) {
   Config config(json);
 
   QREncoder encoder;
-  Message msg = encoder.encode(arguments.message, config.minECL);
+  encoder.allowMicro = config.micro;
+  std::vector<AppendPart> parts;
+  if (!encoder.splitStructured(arguments.message, config.minECL, &parts)) {
+    std::cerr << "Message is too long to fit in 16 QR codes" << std::endl;
+    return -1;
+  }
 
-  QRGrid grid;
-  Bitmap bitmap = grid.generate(msg);
+  if (parts.size() == 1) {
+    Message msg = encoder.encode(arguments.message, config.minECL);
 
-  Decorator::decorate(bitmap, config, arguments.embed, arguments.outfile, arguments.gray, arguments.ppi_x, arguments.ppi_y);
+    QRGrid grid;
+    configureGrid(config, &grid);
+    Bitmap bitmap = grid.generate(msg);
+    reportMask(config, bitmap.micro, grid.lastMask, "");
+
+    Decorator::decorate(bitmap, config, arguments.embed, arguments.outfile, arguments.gray, arguments.ppi_x, arguments.ppi_y);
+    return 0;
+  }
+
+  // Each symbol of a Structured Append sequence is independent, so build
+  // them all at once.
+  std::vector<Image> images(parts.size());
+  std::vector<MaskChoice> masks(parts.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < parts.size(); i++) {
+    threads.emplace_back([&, i]() {
+      QREncoder partEncoder;
+      uint8_t *buffer = new uint8_t[maxMessageBytes];
+      Message msg = partEncoder.encode(parts[i], config.minECL, buffer);
+      QRGrid grid;
+      configureGrid(config, &grid);
+      Bitmap bitmap = grid.generate(msg);
+      masks[i] = grid.lastMask;
+      images[i] = Decorator::render(bitmap, config, arguments.embed);
+      delete [] bitmap.data;
+      delete [] buffer;
+      if (!arguments.compose) {
+        Decorator::save(images[i], partFilename(arguments.outfile, i + 1).c_str(), arguments.gray, arguments.ppi_x, arguments.ppi_y);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < parts.size(); i++) {
+    reportMask(config, false, masks[i],
+               "part " + std::to_string(i + 1) + ": ");
+  }
+
+  if (arguments.compose) {
+    Image image = Decorator::compose(images, config.backgroundColor);
+    Decorator::save(image, arguments.outfile, arguments.gray, arguments.ppi_x, arguments.ppi_y);
+    delete [] image.pixels;
+  }
+  for (Image &image : images) {
+    delete [] image.pixels;
+  }
 }
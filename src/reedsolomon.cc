@@ -0,0 +1,251 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#include "reedsolomon.h"
+#include "qrencoder.h"
+#include "galois.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// The parity register is kept with the highest-order term first, which is
+// also the order the EC codewords are emitted in.  Each data byte shifts
+// the register down by one and adds term * generator, where term is the
+// incoming byte xor the byte shifted out.  The SIMD kernels hold the whole
+// register in vector lanes and multiply the generator by term with two
+// nibble shuffles.
+
+typedef void (*UpdateKernel)(const uint8_t *data, int length, int numEC,
+                             uint8_t *state);
+typedef void (*PairKernel)(const uint8_t *data0, const uint8_t *data1,
+                           int length, int numEC, uint8_t *state0,
+                           uint8_t *state1);
+
+// generator coefficients in register order, zero padded to 32 bytes.
+static void loadGenerator(int numEC, uint8_t *out) {
+  memset(out, 0, 32);
+  for (int k = 0; k < numEC; k++) {
+    out[k] = generators.poly[numEC][numEC - 1 - k];
+  }
+}
+
+static void updateScalar(const uint8_t *data, int length, int numEC,
+                         uint8_t *state) {
+  uint8_t gen[32];
+  loadGenerator(numEC, gen);
+  for (int i = 0; i < length; i++) {
+    uint8_t term = data[i] ^ state[0];
+    if (term == 0) {
+      memmove(state, state + 1, numEC - 1);
+      state[numEC - 1] = 0;
+      continue;
+    }
+    int logTerm = gf.log[term];
+    for (int k = 0; k < numEC - 1; k++) {
+      state[k] = state[k + 1] ^
+          (gen[k] ? gf.exp[gf.log[gen[k]] + logTerm] : 0);
+    }
+    state[numEC - 1] = gen[numEC - 1] ?
+        gf.exp[gf.log[gen[numEC - 1]] + logTerm] : 0;
+  }
+}
+
+static void pairScalar(const uint8_t *data0, const uint8_t *data1,
+                       int length, int numEC, uint8_t *state0,
+                       uint8_t *state1) {
+  updateScalar(data0, length, numEC, state0);
+  updateScalar(data1, length, numEC, state1);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("ssse3")))
+static void updateSSSE3(const uint8_t *data, int length, int numEC,
+                        uint8_t *state) {
+  uint8_t buf[32];
+  loadGenerator(numEC, buf);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i gen0 = _mm_loadu_si128(reinterpret_cast<__m128i *>(buf));
+  __m128i gen1 = _mm_loadu_si128(reinterpret_cast<__m128i *>(buf + 16));
+  __m128i genLo0 = _mm_and_si128(gen0, nibble);
+  __m128i genHi0 = _mm_and_si128(_mm_srli_epi16(gen0, 4), nibble);
+  __m128i genLo1 = _mm_and_si128(gen1, nibble);
+  __m128i genHi1 = _mm_and_si128(_mm_srli_epi16(gen1, 4), nibble);
+
+  memset(buf, 0, 32);
+  memcpy(buf, state, numEC);
+  __m128i reg0 = _mm_loadu_si128(reinterpret_cast<__m128i *>(buf));
+  __m128i reg1 = _mm_loadu_si128(reinterpret_cast<__m128i *>(buf + 16));
+
+  for (int i = 0; i < length; i++) {
+    uint8_t term = data[i] ^ static_cast<uint8_t>(_mm_cvtsi128_si32(reg0));
+    const __m128i *table =
+        reinterpret_cast<const __m128i *>(nibbleTables.mul[term]);
+    __m128i lo = _mm_load_si128(table);
+    __m128i hi = _mm_load_si128(table + 1);
+    reg0 = _mm_alignr_epi8(reg1, reg0, 1);
+    reg1 = _mm_srli_si128(reg1, 1);
+    reg0 = _mm_xor_si128(reg0, _mm_xor_si128(_mm_shuffle_epi8(lo, genLo0),
+                                             _mm_shuffle_epi8(hi, genHi0)));
+    reg1 = _mm_xor_si128(reg1, _mm_xor_si128(_mm_shuffle_epi8(lo, genLo1),
+                                             _mm_shuffle_epi8(hi, genHi1)));
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(buf), reg0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + 16), reg1);
+  memcpy(state, buf, numEC);
+}
+
+__attribute__((target("ssse3")))
+static void pairSSSE3(const uint8_t *data0, const uint8_t *data1,
+                      int length, int numEC, uint8_t *state0,
+                      uint8_t *state1) {
+  updateSSSE3(data0, length, numEC, state0);
+  updateSSSE3(data1, length, numEC, state1);
+}
+
+__attribute__((target("avx2")))
+static void updateAVX2(const uint8_t *data, int length, int numEC,
+                       uint8_t *state) {
+  uint8_t buf[32];
+  loadGenerator(numEC, buf);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i gen = _mm256_loadu_si256(reinterpret_cast<__m256i *>(buf));
+  __m256i genLo = _mm256_and_si256(gen, nibble);
+  __m256i genHi = _mm256_and_si256(_mm256_srli_epi16(gen, 4), nibble);
+
+  memset(buf, 0, 32);
+  memcpy(buf, state, numEC);
+  __m256i reg = _mm256_loadu_si256(reinterpret_cast<__m256i *>(buf));
+
+  for (int i = 0; i < length; i++) {
+    uint8_t term = data[i] ^ static_cast<uint8_t>(
+        _mm_cvtsi128_si32(_mm256_castsi256_si128(reg)));
+    const __m128i *table =
+        reinterpret_cast<const __m128i *>(nibbleTables.mul[term]);
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128(table));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128(table + 1));
+    // shift the whole 32-byte register down one byte across the lanes.
+    __m256i top = _mm256_permute2x128_si256(reg, reg, 0x81);
+    reg = _mm256_alignr_epi8(top, reg, 1);
+    reg = _mm256_xor_si256(reg, _mm256_xor_si256(
+        _mm256_shuffle_epi8(lo, genLo), _mm256_shuffle_epi8(hi, genHi)));
+  }
+
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(buf), reg);
+  memcpy(state, buf, numEC);
+}
+
+__attribute__((target("avx2")))
+static void pairAVX2(const uint8_t *data0, const uint8_t *data1,
+                     int length, int numEC, uint8_t *state0,
+                     uint8_t *state1) {
+  updateAVX2(data0, length, numEC, state0);
+  updateAVX2(data1, length, numEC, state1);
+}
+
+// Runs two equal-length blocks side by side, one per 256-bit half.
+__attribute__((target("avx512f,avx512bw")))
+static void pairAVX512(const uint8_t *data0, const uint8_t *data1,
+                       int length, int numEC, uint8_t *state0,
+                       uint8_t *state1) {
+  uint8_t buf[64];
+  loadGenerator(numEC, buf);
+  memcpy(buf + 32, buf, 32);
+  const __m512i nibble = _mm512_set1_epi8(0x0f);
+  __m512i gen = _mm512_loadu_si512(buf);
+  __m512i genLo = _mm512_and_si512(gen, nibble);
+  __m512i genHi = _mm512_and_si512(_mm512_srli_epi16(gen, 4), nibble);
+
+  memset(buf, 0, 64);
+  memcpy(buf, state0, numEC);
+  memcpy(buf + 32, state1, numEC);
+  __m512i reg = _mm512_loadu_si512(buf);
+
+  for (int i = 0; i < length; i++) {
+    uint8_t term0 = data0[i] ^ static_cast<uint8_t>(
+        _mm_cvtsi128_si32(_mm512_castsi512_si128(reg)));
+    uint8_t term1 = data1[i] ^ static_cast<uint8_t>(
+        _mm_cvtsi128_si32(_mm512_extracti32x4_epi32(reg, 2)));
+    const __m128i *table0 =
+        reinterpret_cast<const __m128i *>(nibbleTables.mul[term0]);
+    const __m128i *table1 =
+        reinterpret_cast<const __m128i *>(nibbleTables.mul[term1]);
+    __m512i lo = _mm512_inserti64x4(_mm512_castsi256_si512(
+        _mm256_broadcastsi128_si256(_mm_load_si128(table0))),
+        _mm256_broadcastsi128_si256(_mm_load_si128(table1)), 1);
+    __m512i hi = _mm512_inserti64x4(_mm512_castsi256_si512(
+        _mm256_broadcastsi128_si256(_mm_load_si128(table0 + 1))),
+        _mm256_broadcastsi128_si256(_mm_load_si128(table1 + 1)), 1);
+    // move lanes 1 and 3 down into lanes 0 and 2, zeroing 1 and 3, so
+    // alignr shifts each 256-bit half down one byte independently.
+    __m512i top = _mm512_maskz_shuffle_i64x2(0x33, reg, reg, 0x31);
+    reg = _mm512_alignr_epi8(top, reg, 1);
+    reg = _mm512_xor_si512(reg, _mm512_xor_si512(
+        _mm512_shuffle_epi8(lo, genLo), _mm512_shuffle_epi8(hi, genHi)));
+  }
+
+  _mm512_storeu_si512(buf, reg);
+  memcpy(state0, buf, numEC);
+  memcpy(state1, buf + 32, numEC);
+}
+
+#endif  // HAVE_X86_KERNELS
+
+struct Kernels {
+  UpdateKernel update = updateScalar;
+  PairKernel pair = pairScalar;
+
+  Kernels() {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+      update = updateSSSE3;
+      pair = pairSSSE3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      update = updateAVX2;
+      pair = pairAVX2;
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+      pair = pairAVX512;
+    }
+#endif
+  }
+};
+
+static const Kernels &kernels() {
+  static const Kernels k;
+  return k;
+}
+
+void ReedSolomon::encode(Block *blocks, int numBlocks, int numEC) {
+  const Kernels &k = kernels();
+  int i = 0;
+  while (i < numBlocks) {
+    if (i + 1 < numBlocks && blocks[i].dataLen == blocks[i + 1].dataLen) {
+      k.pair(blocks[i].data, blocks[i + 1].data, blocks[i].dataLen, numEC,
+             blocks[i].ec, blocks[i + 1].ec);
+      i += 2;
+    } else {
+      k.update(blocks[i].data, blocks[i].dataLen, numEC, blocks[i].ec);
+      i++;
+    }
+  }
+}
+
+void ReedSolomon::update(const uint8_t *data, int length, int numEC,
+                         uint8_t *state) {
+  kernels().update(data, length, numEC, state);
+}
+
+void ReedSolomon::mulAdd(uint8_t coeff, const uint8_t *row, int numEC,
+                         uint8_t *state) {
+  const uint8_t *table = nibbleTables.mul[coeff];
+  for (int i = 0; i < numEC; i++) {
+    state[i] ^= table[row[i] & 0xf] ^ table[16 + (row[i] >> 4)];
+  }
+}
@@ -0,0 +1,20 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#pragma once
+
+#include <cstdint>
+
+struct Block;
+
+class ReedSolomon {
+ public:
+  // Fill in the ec codewords of every block.  The ec arrays must be zeroed.
+  static void encode(Block *blocks, int numBlocks, int numEC);
+  // Shift data through the parity register.  state holds numEC bytes in
+  // output order, zeroed for a fresh block; afterwards it is the parity.
+  static void update(const uint8_t *data, int length, int numEC,
+                     uint8_t *state);
+  // state ^= coeff * row, for adding in the parity of a changed byte.
+  static void mulAdd(uint8_t coeff, const uint8_t *row, int numEC,
+                     uint8_t *state);
+};
@@ -0,0 +1,85 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#include "symbolcache.h"
+
+SymbolCache::SymbolCache(size_t capacity) : capacity(capacity) {
+}
+
+std::shared_ptr<const Bitmap> SymbolCache::get(std::string_view msg, ECL ecl,
+                                               bool micro,
+                                               const MaskOptions &masks) {
+  std::string key = makeKey(msg, ecl, micro, masks);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (found != index.end()) {
+      entries.splice(entries.begin(), entries, found->second);
+      counters.hits++;
+      return found->second->second;
+    }
+    counters.misses++;
+  }
+
+  // generate without holding the lock, so misses don't wait on each other.
+  std::shared_ptr<const Bitmap> bitmap = generate(msg, ecl, micro, masks);
+  if (bitmap == nullptr || capacity == 0) {
+    return bitmap;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = index.find(key);
+  if (found != index.end()) {
+    // another thread got here first; keep its copy.
+    entries.splice(entries.begin(), entries, found->second);
+    return found->second->second;
+  }
+  entries.emplace_front(key, bitmap);
+  index[key] = entries.begin();
+  while (entries.size() > capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+    counters.evictions++;
+  }
+  return bitmap;
+}
+
+SymbolCache::Stats SymbolCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+// The options go on the end with a fixed width, so no two keys collide.
+std::string SymbolCache::makeKey(std::string_view msg, ECL ecl, bool micro,
+                                 const MaskOptions &masks) {
+  std::string key(msg);
+  key += static_cast<char>(ecl);
+  key += static_cast<char>(micro);
+  key += static_cast<char>(masks.parallelMasks);
+  key += static_cast<char>(masks.maskMode);
+  key += static_cast<char>(masks.fixedMask);
+  key.append(reinterpret_cast<const char *>(&masks.maskBudget),
+             sizeof(masks.maskBudget));
+  return key;
+}
+
+std::shared_ptr<const Bitmap> SymbolCache::generate(std::string_view msg,
+                                                    ECL ecl, bool micro,
+                                                    const MaskOptions &masks) {
+  QREncoder encoder;
+  encoder.allowMicro = micro;
+  uint8_t buffer[maxMessageBytes];
+  Message message = encoder.encode(msg, ecl, buffer);
+  if (message.data == nullptr) {
+    return nullptr;
+  }
+  QRGrid grid;
+  grid.parallelMasks = masks.parallelMasks;
+  grid.maskMode = masks.maskMode;
+  grid.fixedMask = masks.fixedMask;
+  grid.maskBudget = masks.maskBudget;
+  Bitmap *bitmap = new Bitmap(grid.generate(message));
+  return std::shared_ptr<const Bitmap>(bitmap, [](const Bitmap *b) {
+    delete [] b->data;
+    delete b;
+  });
+}
@@ -0,0 +1,57 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "qrencoder.h"
+#include "qrgrid.h"
+
+// The QRGrid options that pick each symbol's mask.
+struct MaskOptions {
+  bool parallelMasks = false;
+  MaskMode maskMode = MaskMode::Optimal;
+  int fixedMask = 0;
+  uint32_t maskBudget = 0;
+};
+
+// A bounded, thread-safe LRU cache of finished module matrices, so a
+// repeated message skips encoding and the mask search.
+class SymbolCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  explicit SymbolCache(size_t capacity);
+
+  // Returns the matrix for msg, generating it on a miss, or nullptr if msg
+  // is too long.  The bitmap is shared, so callers must not change it.
+  // Symbols made with different mask options are kept apart.
+  std::shared_ptr<const Bitmap> get(std::string_view msg, ECL ecl,
+                                    bool micro,
+                                    const MaskOptions &masks = MaskOptions());
+  Stats stats() const;
+
+ private:
+  typedef std::pair<std::string, std::shared_ptr<const Bitmap>> Entry;
+
+  static std::string makeKey(std::string_view msg, ECL ecl, bool micro,
+                             const MaskOptions &masks);
+  static std::shared_ptr<const Bitmap> generate(std::string_view msg,
+                                                ECL ecl, bool micro,
+                                                const MaskOptions &masks);
+
+  size_t capacity;
+  mutable std::mutex mutex;
+  std::list<Entry> entries;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  Stats counters;
+};
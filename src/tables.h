@@ -2,41 +2,6 @@
 
 #pragma once
 
-static const struct {
-  ECL ecl;
-  int numericMax;
-  int alphaMax;
-  int byteMax;
-  int version;
-} modes[] = {
-  { ECL::L, 41, 25, 17, 1 },
-  { ECL::M, 34, 20, 14, 1 },
-  { ECL::Q, 27, 16, 11, 1 },
-  { ECL::H, 17, 10, 7, 1 },
-  { ECL::L, 77, 47, 32, 2 },
-  { ECL::M, 63, 38, 26, 2 },
-  { ECL::Q, 48, 29, 20, 2 },
-  { ECL::H, 34, 20, 14, 2 },
-  { ECL::L, 127, 77, 53, 3 },
-  { ECL::M, 101, 61, 42, 3 },
-  { ECL::Q, 77, 47, 32, 3 },
-  { ECL::H, 58, 35, 24, 3 },
-  { ECL::L, 187, 114, 78, 4 },
-  { ECL::M, 149, 90, 62, 4 },
-  { ECL::Q, 111, 67, 46, 4 },
-  { ECL::H, 82, 50, 34, 4 },
-  { ECL::L, 255, 154, 106, 5 },
-  { ECL::M, 202, 122, 84, 5 },
-  { ECL::Q, 144, 87, 60, 5 },
-  { ECL::H, 106, 64, 44, 5 },
-  { ECL::L, 322, 195, 134, 6 },
-  { ECL::M, 255, 154, 106, 6 },
-  { ECL::Q, 178, 108, 74, 6 },
-  { ECL::H, 139, 84, 58, 6 },
-};
-
-#define numModes (sizeof(modes) / sizeof(modes[0]))
-
 static const struct {
   int version;
   ECL ecl;
@@ -70,6 +35,169 @@ static const struct {
   { 6, ECL::M, 16, 4, 27, 0, 0 },
   { 6, ECL::Q, 24, 4, 19, 0, 0 },
   { 6, ECL::H, 28, 4, 15, 0, 0 },
+  { 7, ECL::L, 20, 2, 78, 0, 0 },
+  { 7, ECL::M, 18, 4, 31, 0, 0 },
+  { 7, ECL::Q, 18, 2, 14, 4, 15 },
+  { 7, ECL::H, 26, 4, 13, 1, 14 },
+  { 8, ECL::L, 24, 2, 97, 0, 0 },
+  { 8, ECL::M, 22, 2, 38, 2, 39 },
+  { 8, ECL::Q, 22, 4, 18, 2, 19 },
+  { 8, ECL::H, 26, 4, 14, 2, 15 },
+  { 9, ECL::L, 30, 2, 116, 0, 0 },
+  { 9, ECL::M, 22, 3, 36, 2, 37 },
+  { 9, ECL::Q, 20, 4, 16, 4, 17 },
+  { 9, ECL::H, 24, 4, 12, 4, 13 },
+  { 10, ECL::L, 18, 2, 68, 2, 69 },
+  { 10, ECL::M, 26, 4, 43, 1, 44 },
+  { 10, ECL::Q, 24, 6, 19, 2, 20 },
+  { 10, ECL::H, 28, 6, 15, 2, 16 },
+  { 11, ECL::L, 20, 4, 81, 0, 0 },
+  { 11, ECL::M, 30, 1, 50, 4, 51 },
+  { 11, ECL::Q, 28, 4, 22, 4, 23 },
+  { 11, ECL::H, 24, 3, 12, 8, 13 },
+  { 12, ECL::L, 24, 2, 92, 2, 93 },
+  { 12, ECL::M, 22, 6, 36, 2, 37 },
+  { 12, ECL::Q, 26, 4, 20, 6, 21 },
+  { 12, ECL::H, 28, 7, 14, 4, 15 },
+  { 13, ECL::L, 26, 4, 107, 0, 0 },
+  { 13, ECL::M, 22, 8, 37, 1, 38 },
+  { 13, ECL::Q, 24, 8, 20, 4, 21 },
+  { 13, ECL::H, 22, 12, 11, 4, 12 },
+  { 14, ECL::L, 30, 3, 115, 1, 116 },
+  { 14, ECL::M, 24, 4, 40, 5, 41 },
+  { 14, ECL::Q, 20, 11, 16, 5, 17 },
+  { 14, ECL::H, 24, 11, 12, 5, 13 },
+  { 15, ECL::L, 22, 5, 87, 1, 88 },
+  { 15, ECL::M, 24, 5, 41, 5, 42 },
+  { 15, ECL::Q, 30, 5, 24, 7, 25 },
+  { 15, ECL::H, 24, 11, 12, 7, 13 },
+  { 16, ECL::L, 24, 5, 98, 1, 99 },
+  { 16, ECL::M, 28, 7, 45, 3, 46 },
+  { 16, ECL::Q, 24, 15, 19, 2, 20 },
+  { 16, ECL::H, 30, 3, 15, 13, 16 },
+  { 17, ECL::L, 28, 1, 107, 5, 108 },
+  { 17, ECL::M, 28, 10, 46, 1, 47 },
+  { 17, ECL::Q, 28, 1, 22, 15, 23 },
+  { 17, ECL::H, 28, 2, 14, 17, 15 },
+  { 18, ECL::L, 30, 5, 120, 1, 121 },
+  { 18, ECL::M, 26, 9, 43, 4, 44 },
+  { 18, ECL::Q, 28, 17, 22, 1, 23 },
+  { 18, ECL::H, 28, 2, 14, 19, 15 },
+  { 19, ECL::L, 28, 3, 113, 4, 114 },
+  { 19, ECL::M, 26, 3, 44, 11, 45 },
+  { 19, ECL::Q, 26, 17, 21, 4, 22 },
+  { 19, ECL::H, 26, 9, 13, 16, 14 },
+  { 20, ECL::L, 28, 3, 107, 5, 108 },
+  { 20, ECL::M, 26, 3, 41, 13, 42 },
+  { 20, ECL::Q, 30, 15, 24, 5, 25 },
+  { 20, ECL::H, 28, 15, 15, 10, 16 },
+  { 21, ECL::L, 28, 4, 116, 4, 117 },
+  { 21, ECL::M, 26, 17, 42, 0, 0 },
+  { 21, ECL::Q, 28, 17, 22, 6, 23 },
+  { 21, ECL::H, 30, 19, 16, 6, 17 },
+  { 22, ECL::L, 28, 2, 111, 7, 112 },
+  { 22, ECL::M, 28, 17, 46, 0, 0 },
+  { 22, ECL::Q, 30, 7, 24, 16, 25 },
+  { 22, ECL::H, 24, 34, 13, 0, 0 },
+  { 23, ECL::L, 30, 4, 121, 5, 122 },
+  { 23, ECL::M, 28, 4, 47, 14, 48 },
+  { 23, ECL::Q, 30, 11, 24, 14, 25 },
+  { 23, ECL::H, 30, 16, 15, 14, 16 },
+  { 24, ECL::L, 30, 6, 117, 4, 118 },
+  { 24, ECL::M, 28, 6, 45, 14, 46 },
+  { 24, ECL::Q, 30, 11, 24, 16, 25 },
+  { 24, ECL::H, 30, 30, 16, 2, 17 },
+  { 25, ECL::L, 26, 8, 106, 4, 107 },
+  { 25, ECL::M, 28, 8, 47, 13, 48 },
+  { 25, ECL::Q, 30, 7, 24, 22, 25 },
+  { 25, ECL::H, 30, 22, 15, 13, 16 },
+  { 26, ECL::L, 28, 10, 114, 2, 115 },
+  { 26, ECL::M, 28, 19, 46, 4, 47 },
+  { 26, ECL::Q, 28, 28, 22, 6, 23 },
+  { 26, ECL::H, 30, 33, 16, 4, 17 },
+  { 27, ECL::L, 30, 8, 122, 4, 123 },
+  { 27, ECL::M, 28, 22, 45, 3, 46 },
+  { 27, ECL::Q, 30, 8, 23, 26, 24 },
+  { 27, ECL::H, 30, 12, 15, 28, 16 },
+  { 28, ECL::L, 30, 3, 117, 10, 118 },
+  { 28, ECL::M, 28, 3, 45, 23, 46 },
+  { 28, ECL::Q, 30, 4, 24, 31, 25 },
+  { 28, ECL::H, 30, 11, 15, 31, 16 },
+  { 29, ECL::L, 30, 7, 116, 7, 117 },
+  { 29, ECL::M, 28, 21, 45, 7, 46 },
+  { 29, ECL::Q, 30, 1, 23, 37, 24 },
+  { 29, ECL::H, 30, 19, 15, 26, 16 },
+  { 30, ECL::L, 30, 5, 115, 10, 116 },
+  { 30, ECL::M, 28, 19, 47, 10, 48 },
+  { 30, ECL::Q, 30, 15, 24, 25, 25 },
+  { 30, ECL::H, 30, 23, 15, 25, 16 },
+  { 31, ECL::L, 30, 13, 115, 3, 116 },
+  { 31, ECL::M, 28, 2, 46, 29, 47 },
+  { 31, ECL::Q, 30, 42, 24, 1, 25 },
+  { 31, ECL::H, 30, 23, 15, 28, 16 },
+  { 32, ECL::L, 30, 17, 115, 0, 0 },
+  { 32, ECL::M, 28, 10, 46, 23, 47 },
+  { 32, ECL::Q, 30, 10, 24, 35, 25 },
+  { 32, ECL::H, 30, 19, 15, 35, 16 },
+  { 33, ECL::L, 30, 17, 115, 1, 116 },
+  { 33, ECL::M, 28, 14, 46, 21, 47 },
+  { 33, ECL::Q, 30, 29, 24, 19, 25 },
+  { 33, ECL::H, 30, 11, 15, 46, 16 },
+  { 34, ECL::L, 30, 13, 115, 6, 116 },
+  { 34, ECL::M, 28, 14, 46, 23, 47 },
+  { 34, ECL::Q, 30, 44, 24, 7, 25 },
+  { 34, ECL::H, 30, 59, 16, 1, 17 },
+  { 35, ECL::L, 30, 12, 121, 7, 122 },
+  { 35, ECL::M, 28, 12, 47, 26, 48 },
+  { 35, ECL::Q, 30, 39, 24, 14, 25 },
+  { 35, ECL::H, 30, 22, 15, 41, 16 },
+  { 36, ECL::L, 30, 6, 121, 14, 122 },
+  { 36, ECL::M, 28, 6, 47, 34, 48 },
+  { 36, ECL::Q, 30, 46, 24, 10, 25 },
+  { 36, ECL::H, 30, 2, 15, 64, 16 },
+  { 37, ECL::L, 30, 17, 122, 4, 123 },
+  { 37, ECL::M, 28, 29, 46, 14, 47 },
+  { 37, ECL::Q, 30, 49, 24, 10, 25 },
+  { 37, ECL::H, 30, 24, 15, 46, 16 },
+  { 38, ECL::L, 30, 4, 122, 18, 123 },
+  { 38, ECL::M, 28, 13, 46, 32, 47 },
+  { 38, ECL::Q, 30, 48, 24, 14, 25 },
+  { 38, ECL::H, 30, 42, 15, 32, 16 },
+  { 39, ECL::L, 30, 20, 117, 4, 118 },
+  { 39, ECL::M, 28, 40, 47, 7, 48 },
+  { 39, ECL::Q, 30, 43, 24, 22, 25 },
+  { 39, ECL::H, 30, 10, 15, 67, 16 },
+  { 40, ECL::L, 30, 19, 118, 6, 119 },
+  { 40, ECL::M, 28, 18, 47, 31, 48 },
+  { 40, ECL::Q, 30, 34, 24, 34, 25 },
+  { 40, ECL::H, 30, 20, 15, 61, 16 },
 };
 
 #define numECs (sizeof(ecTable) / sizeof(ecTable[0]))
+
+// Bits left over after the last codeword, indexed by version - 1.
+static const int remainderBits[] = {
+  0, 7, 7, 7, 7, 7, 0, 0, 0, 0, 0, 0, 0, 3, 3, 3, 3, 3, 3, 3,
+  4, 4, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 0, 0,
+};
+
+// Micro QR data capacity in bits and EC codewords.  M1 and M3 end with a
+// 4-bit data codeword.  M1 only detects errors; it's listed as L.  The
+// index into this table is the symbol number used by the format bits.
+static const struct {
+  int version;
+  ECL ecl;
+  int dataBits;
+  int ecCodewords;
+} microTable[] = {
+  { 1, ECL::L, 20, 2 },
+  { 2, ECL::L, 40, 5 },
+  { 2, ECL::M, 32, 6 },
+  { 3, ECL::L, 84, 6 },
+  { 3, ECL::M, 68, 8 },
+  { 4, ECL::L, 128, 8 },
+  { 4, ECL::M, 112, 10 },
+  { 4, ECL::Q, 80, 14 },
+};
+
+#define numMicros (sizeof(microTable) / sizeof(microTable[0]))
@@ -0,0 +1,75 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#include "workerpool.h"
+#include <algorithm>
+
+WorkerPool &WorkerPool::shared(int maxThreads) {
+  static WorkerPool pool(std::min<int>(std::thread::hardware_concurrency(),
+                                       maxThreads) - 1);
+  return pool;
+}
+
+WorkerPool::WorkerPool(int numThreads) {
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back(&WorkerPool::worker, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+void WorkerPool::run(int count, const std::function<void(int)> &work) {
+  std::unique_lock<std::mutex> owner(busy, std::try_to_lock);
+  if (!owner.owns_lock() || threads.empty()) {
+    for (int i = 0; i < count; i++) {
+      work(i);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &work;
+    this->count = count;
+    next = 0;
+    finished = 0;
+    generation++;
+  }
+  wake.notify_all();
+  takeItems();
+  // every thread has to finish with the job before it goes out of scope.
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return finished == threads.size(); });
+  job = nullptr;
+}
+
+void WorkerPool::worker() {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    lock.unlock();
+    takeItems();
+    lock.lock();
+    if (++finished == threads.size()) {
+      done.notify_one();
+    }
+  }
+}
+
+void WorkerPool::takeItems() {
+  for (int i = next++; i < count; i = next++) {
+    (*job)(i);
+  }
+}
@@ -0,0 +1,42 @@
+/** @copyright 2019 Arizona Daily Star.  Developed by Sean Kasun. */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A few threads started once and kept around, so that small jobs can be
+// spread across cores without spawning threads for each one.
+class WorkerPool {
+ public:
+  // The shared pool, with one thread per core besides the caller's, up
+  // to maxThreads.
+  static WorkerPool &shared(int maxThreads);
+  ~WorkerPool();
+
+  // Calls work(i) for every i below count and returns once they have all
+  // finished.  The calling thread takes items too.  If another job already
+  // has the pool, the caller just runs every item itself.
+  void run(int count, const std::function<void(int)> &work);
+
+ private:
+  explicit WorkerPool(int numThreads);
+  void worker();
+  void takeItems();
+
+  std::vector<std::thread> threads;
+  std::mutex busy;  // held by the caller that owns the current job
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(int)> *job = nullptr;
+  int count = 0;
+  std::atomic<int> next{0};
+  size_t finished = 0;  // threads done with the current job
+  uint64_t generation = 0;
+  bool stopping = false;
+};